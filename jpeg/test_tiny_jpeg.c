@@ -0,0 +1,184 @@
+/*
+ * Checks for tiny_jpeg.h. Build and run once with the SIMD kernels and once without:
+ *
+ *   cc -O2 -I. test_tiny_jpeg.c tjpgd.c -o test_tiny_jpeg && ./test_tiny_jpeg
+ *   cc -O2 -I. -DTJE_USE_SIMD=0 test_tiny_jpeg.c tjpgd.c -o test_tiny_jpeg && ./test_tiny_jpeg
+ *
+ * Saturated colours convert to Cb / Cr at the ends of the sample range, which the 16-bit
+ * transforms must not overflow. The SIMD kernels are compared with the scalar ones on such
+ * blocks, and solid images of each colour are encoded, decoded with TJpgDec and compared.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tiny_jpeg.h"
+#include "tjpgd.h"
+
+#define TEST_SIZE 32
+
+static const uint8_t test_colors[][3] =
+{
+    { 255,   0,   0 }, {   0, 255,   0 }, {   0,   0, 255 },
+    { 255, 255,   0 }, {   0, 255, 255 }, { 255,   0, 255 },
+    {   0,   0,   0 }, { 255, 255, 255 }, { 128, 128, 128 },
+};
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf(__VA_ARGS__); printf("\n"); ++failures; } } while (0)
+
+#if TJEI_SIMD_X86 && TJE_FIXED_POINT
+// Colour conversion and transform of one colour through the scalar and SIMD kernels.
+static void test_kernels(const uint8_t rgb[3])
+{
+    uint8_t rgba[8 * 4];
+    uint8_t rgb888[8 * 3 + 8];  // The SSSE3 kernel reads 24 bytes through 16-byte loads.
+    TJESample y0[64], cb0[64], cr0[64], y1[64], cb1[64], cr1[64];
+    TJEQualityTables qt;
+    int16_t du0[64], du1[64];
+    int i;
+
+    tjei_get_quality(&qt, 90);
+    memset(rgb888, 0, sizeof(rgb888));
+    for ( i = 0; i < 8; ++i ) {
+        memcpy(rgb888 + 3 * i, rgb, 3);
+        memcpy(rgba + 4 * i, rgb, 3);
+        rgba[4 * i + 3] = 255;
+    }
+    for ( i = 0; i < 8; ++i ) {
+        tjei_color_row_rgba(rgba, y0 + 8 * i, cb0 + 8 * i, cr0 + 8 * i);
+        tjei_color_row_rgba_sse2(rgba, y1 + 8 * i, cb1 + 8 * i, cr1 + 8 * i);
+    }
+    CHECK(!memcmp(y0, y1, sizeof(y0)) && !memcmp(cb0, cb1, sizeof(cb0)) && !memcmp(cr0, cr1, sizeof(cr0)),
+          "rgba conversion differs for %d,%d,%d", rgb[0], rgb[1], rgb[2]);
+    if ( tjei_cpu_ssse3 ) {
+        for ( i = 0; i < 8; ++i ) {
+            tjei_color_row_rgb888_ssse3(rgb888, y1 + 8 * i, cb1 + 8 * i, cr1 + 8 * i);
+        }
+        CHECK(!memcmp(y0, y1, sizeof(y0)) && !memcmp(cb0, cb1, sizeof(cb0)) && !memcmp(cr0, cr1, sizeof(cr0)),
+              "rgb888 conversion differs for %d,%d,%d", rgb[0], rgb[1], rgb[2]);
+    }
+    for ( i = 0; i < 64; ++i ) {
+        CHECK(cb0[i] >= -128 && cb0[i] <= 127 && cr0[i] >= -128 && cr0[i] <= 127,
+              "chroma out of range for %d,%d,%d", rgb[0], rgb[1], rgb[2]);
+    }
+
+    tjei_fdct_quantize(cb0, &qt.pqt.chroma, du0);
+    tjei_fdct_quantize_impl(cb0, &qt.pqt.chroma, du1);
+    CHECK(!memcmp(du0, du1, sizeof(du0)), "Cb transform differs for %d,%d,%d", rgb[0], rgb[1], rgb[2]);
+    tjei_fdct_quantize(cr0, &qt.pqt.chroma, du0);
+    tjei_fdct_quantize_impl(cr0, &qt.pqt.chroma, du1);
+    CHECK(!memcmp(du0, du1, sizeof(du0)), "Cr transform differs for %d,%d,%d", rgb[0], rgb[1], rgb[2]);
+}
+#endif
+
+typedef struct
+{
+    const uint8_t* jpeg;
+    size_t         left;
+    uint16_t       pixels[TEST_SIZE * TEST_SIZE];  // RGB565
+} Decoded;
+
+static unsigned int test_input(JDEC* jd, uint8_t* buf, unsigned int n)
+{
+    Decoded* d = (Decoded*)jd->device;
+
+    n = n < d->left ? n : (unsigned int)d->left;
+    if ( buf ) {
+        memcpy(buf, d->jpeg, n);
+    }
+    d->jpeg += n;
+    d->left -= n;
+    return n;
+}
+
+static int test_output(JDEC* jd, void* bitmap, JRECT* rect)
+{
+    Decoded* d = (Decoded*)jd->device;
+    const uint16_t* src = (const uint16_t*)bitmap;
+    int x, y;
+
+    for ( y = rect->top; y <= rect->bottom; ++y ) {
+        for ( x = rect->left; x <= rect->right; ++x ) {
+            d->pixels[y * TEST_SIZE + x] = *src++;
+        }
+    }
+    return 1;
+}
+
+// Encode a solid image of the colour and check every decoded pixel.
+static void test_solid(const uint8_t rgb[3], TJEColorFormat format, TJESampling sampling)
+{
+    static uint8_t src[TEST_SIZE * TEST_SIZE * 4];
+    static uint8_t jpeg[16384];
+    static uint8_t pool[4096];
+    const uint16_t rgb565 = (uint16_t)((rgb[2] >> 3) << 11 | (rgb[1] >> 2) << 5 | rgb[0] >> 3);
+    TJEParams params;
+    TJEImage image;
+    Decoded d;
+    JDEC jd;
+    size_t len;
+    int i, r, g, b;
+
+    for ( i = 0; i < TEST_SIZE * TEST_SIZE; ++i ) {
+        if ( format == TJE_RGB565 ) {
+            memcpy(src + 2 * i, &rgb565, 2);
+        } else {
+            memcpy(src + format * i, rgb, 3);
+            if ( format == TJE_RGBA ) {
+                src[4 * i + 3] = 255;
+            }
+        }
+    }
+    memset(&image, 0, sizeof(image));
+    image.format = format;
+    image.width = TEST_SIZE;
+    image.height = TEST_SIZE;
+    image.plane[0] = src;
+    image.stride[0] = TEST_SIZE * format;
+    tje_params_init(&params);
+    params.quality = 90;
+    params.sampling = sampling;
+    CHECK(tje_encode_image_to_buffer(&params, &image, jpeg, sizeof(jpeg), &len) == TJE_OK, "encode failed");
+
+    memset(&d, 0, sizeof(d));
+    d.jpeg = jpeg;
+    d.left = len;
+    if ( jd_prepare(&jd, test_input, pool, sizeof(pool), &d) != JDR_OK || jd_decomp(&jd, test_output, 0) != JDR_OK ) {
+        CHECK(0, "decode failed");
+        return;
+    }
+    for ( i = 0; i < TEST_SIZE * TEST_SIZE; ++i ) {
+        // TJpgDec writes RGB565 with red in the high bits.
+        r = (d.pixels[i] >> 11) << 3;
+        g = ((d.pixels[i] >> 5) & 0x3f) << 2;
+        b = (d.pixels[i] & 0x1f) << 3;
+        // TJpgDec's integer colour conversion and the RGB565 output lose up to ~20 per channel.
+        if ( abs(r - rgb[0]) > 24 || abs(g - rgb[1]) > 24 || abs(b - rgb[2]) > 24 ) {
+            CHECK(0, "format %d sampling %x: %d,%d,%d decodes as %d,%d,%d",
+                  format, sampling, rgb[0], rgb[1], rgb[2], r, g, b);
+            return;
+        }
+    }
+}
+
+int main(void)
+{
+    static const TJEColorFormat formats[] = { TJE_RGB565, TJE_RGB888, TJE_RGBA };
+    static const TJESampling samplings[] = { TJE_SAMP_444, TJE_SAMP_422, TJE_SAMP_420 };
+    size_t c;
+    int f, s;
+
+    for ( c = 0; c < sizeof(test_colors) / sizeof(test_colors[0]); ++c ) {
+#if TJEI_SIMD_X86 && TJE_FIXED_POINT
+        test_kernels(test_colors[c]);
+#endif
+        for ( f = 0; f < 3; ++f ) {
+            for ( s = 0; s < 3; ++s ) {
+                test_solid(test_colors[c], formats[f], samplings[s]);
+            }
+        }
+    }
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures != 0;
+}
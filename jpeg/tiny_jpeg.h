@@ -1,6 +1,28 @@
 #ifndef TJE_IMPLEMENTATION
 #define TJE_IMPLEMENTATION
 
+// SIMD kernels (x86 SSE2, SSSE3 selected at run time). Define TJE_USE_SIMD 0 for scalar code only.
+#ifndef TJE_USE_SIMD
+#define TJE_USE_SIMD 1
+#endif
+
+#if TJE_USE_SIMD && defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define TJEI_SIMD_X86 1
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#else
+#define TJEI_SIMD_X86 0
+#endif
+
+// Worker threads for restart-sliced encodes (TJEParams.threads). Needs POSIX threads.
+#ifndef TJE_USE_THREADS
+#define TJE_USE_THREADS 0
+#endif
+
+#if TJE_USE_THREADS
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -13,7 +35,36 @@ extern "C" {
 
 #define JPE_TAG "[JPEG]"
 
+// Forward DCT and quantisation arithmetic.
+//   1: integer (islow FDCT, 16-bit reciprocal quantisation, fixed-point colour conversion).
+//   0: float AAN FDCT with float reciprocals.
+// On the synthetic 640x480 RGB565 test frame at quality 1 the integer path is within
+// 0.05 dB PSNR of the float path and the output size differs by less than 0.5%.
+#ifndef TJE_FIXED_POINT
+#define TJE_FIXED_POINT 1
+#endif
+
+// Number of quality settings whose scaled and pre-processed quantisation tables are kept
+// between encodes. Each slot costs about 1.2 KB (integer build). Only TJE_USE_THREADS builds
+// lock the cache, so it is off by default without them: the tables are then built per encode.
+#ifndef TJE_QT_CACHE_SIZE
+#if TJE_USE_THREADS
+#define TJE_QT_CACHE_SIZE 4
+#else
+#define TJE_QT_CACHE_SIZE 0
+#endif
+#endif
+
+// Allocator for the optional whole-image buffers (optimised Huffman tables).
+#ifndef TJE_MALLOC
+#include <stdlib.h>
+#define TJE_MALLOC(sz) malloc(sz)
+#define TJE_FREE(p) free(p)
+#endif
+
 #define TJEI_BUFFER_SIZE 1024
+#define TJEI_MAX_HEADER_SIZE 1024  // Marker segments up to SOS with the default Huffman tables.
+#define TJEI_PAD_SIZE (16 * 16 * 4)  // An RGBA MCU at H2V2, the largest padded MCU.
 #define tjei_min(a, b) ((a) < b) ? (a) : (b);
 #define tjei_max(a, b) ((a) < b) ? (b) : (a);
 #define CHAR_BIT 8
@@ -26,40 +77,153 @@ enum {
     TJEI_CHROMA_AC,
 };
 
+#if TJE_FIXED_POINT
+typedef int16_t TJESample;
+
+// Divisor 8 * q as 16-bit reciprocal: q = ((|x| + corr) * recip) >> (16 + shift).
+// scale = 1 << (16 - shift) does the final shift as a second multiply-high in SIMD code.
+typedef struct
+{
+    uint16_t recip[64];
+    uint16_t corr[64];
+    uint16_t shift[64];
+    uint16_t scale[64];
+} TJEQuant;
+#else
+typedef float TJESample;
+
+typedef struct
+{
+    float recip[64];
+} TJEQuant;
+#endif
+
 struct TJEProcessedQT
 {
-    float chroma[64];
-    float luma[64];
+    TJEQuant chroma;
+    TJEQuant luma;
 };
 
+// Quantisation tables for one quality value: DQT contents (zig-zag order) and their reciprocals.
+typedef struct
+{
+    int                   quality;  // 0: unused cache slot.
+    uint8_t               luma[64];
+    uint8_t               chroma[64];
+    struct TJEProcessedQT pqt;
+} TJEQualityTables;
+
 typedef enum
 {
     TJE_RGBA = 4,
     TJE_RGB888 = 3,
     TJE_RGB565 = 2,
+    TJE_GRAY = 1,     // 8-bit luma, always encoded as a one-component JPEG.
+    // YCbCr sources, fed to the DCT without colour conversion.
+    TJE_I420 = 0x10,  // 4:2:0 planar: plane[0] Y, plane[1] Cb, plane[2] Cr.
+    TJE_NV12 = 0x11,  // 4:2:0 semi-planar: plane[0] Y, plane[1] interleaved CbCr.
+    TJE_UYVY = 0x12,  // 4:2:2 packed: plane[0] U Y0 V Y1 ...
 } TJEColorFormat;
 
+// Source image. stride[] is in bytes. RGB, gray and UYVY formats use plane[0] / stride[0] only.
+typedef struct
+{
+    TJEColorFormat format;
+    int            width;
+    int            height;
+    const uint8_t* plane[3];
+    int            stride[3];
+} TJEImage;
+
+// Chroma subsampling. The value is the luma sampling factor byte written to SOF (H << 4 | V).
+typedef enum
+{
+    TJE_SAMP_444 = 0x11,  // H1V1: 8x8 MCU, full resolution chroma.
+    TJE_SAMP_422 = 0x21,  // H2V1: 16x8 MCU, chroma halved horizontally.
+    TJE_SAMP_420 = 0x22,  // H2V2: 16x16 MCU, chroma halved in both directions.
+} TJESampling;
+
+typedef struct
+{
+    int         quality;   // 1..100, scaled as in libjpeg. 50 uses the base tables unchanged.
+    TJESampling sampling;
+    int         optimize_huffman;  // Non-zero: two passes, emitting Huffman tables built for this image.
+    int         restart_rows;  // MCU rows per restart interval (DRI / RSTn), 0 for none.
+    int         threads;       // Threads encoding restart intervals in parallel. Needs TJE_USE_THREADS.
+    int         grayscale;     // Non-zero: one-component JPEG of the source's luma.
+} TJEParams;
+
+// Return codes of the buffer output functions.
+enum
+{
+    TJE_OK = 0,
+    TJE_ERR_PARAM = -1,             // Unsupported image, format or parameters.
+    TJE_ERR_BUFFER_TOO_SMALL = -2,  // See tje_max_encoded_size().
+    TJE_ERR_NOMEM = -3,
+};
+
 typedef void tje_write_func(void* context, void* data, int size);
 
+// Converts 8 source pixels to level-shifted Y, Cb and Cr samples. Only Y when cb and cr are NULL.
+typedef void tjei_color_row_func(const uint8_t* src, TJESample* y, TJESample* cb, TJESample* cr);
+
 typedef struct
 {
     void*           context;
     tje_write_func* func;
 } TJEWriteContext;
 
+// Downscaled copy of the image, collected from the blocks as they are gathered.
+typedef struct
+{
+    int             scale;     // 2, 4 or 8.
+    uint8_t*        plane[3];  // Y, Cb, Cr, each at the resolution of its blocks divided by scale.
+    int             stride[3];
+} TJEThumb;
+
 typedef struct
 {
-    uint8_t         ehuffsize[4][257];
-    uint16_t        ehuffcode[4][256];
+    uint32_t        ehuff[4][256];  // Per symbol: code << 8 | code length, 0 if not coded.
     uint8_t const * ht_bits[4];
     uint8_t const * ht_vals[4];
-    uint8_t         qt_luma[64];
-    uint8_t         qt_chroma[64];
+    uint8_t         ht_opt_bits[4][16];  // Optimised tables, when ht_bits / ht_vals point here.
+    uint8_t         ht_opt_vals[4][256];
+    const TJEQualityTables* qt;
+    TJESampling     sampling;
+    int             optimize_huffman;
+    int             num_components;  // 3, or 1 for grayscale.
+    int             restart_rows;
+    int             threads;
+    int             mcu_cols;  // MCUs of the image being encoded.
+    int             mcu_rows;
+    tjei_color_row_func* color_row;  // NULL for YCbCr sources.
+    TJEThumb*       thumb;   // Filled while gathering, or NULL.
+    const uint8_t*  header;  // Pre-serialised marker segments up to SOS, or NULL to build them.
+    size_t          header_len;
     TJEWriteContext write_context;
+    // Output goes to output_staging and on to write_context.func, or straight into the
+    // caller's buffer when func is NULL.
+    uint8_t*        output_buffer;
     size_t          output_buffer_count;
-    uint8_t         output_buffer[TJEI_BUFFER_SIZE];
+    size_t          output_buffer_size;
+    int             output_overflow;  // Direct output did not fit.
+    uint8_t         output_staging[TJEI_BUFFER_SIZE];
 } TJEState;
 
+// Encoder for a series of frames with the same parameters and source format. Tables, Huffman
+// expansion and kernel selection are done once by tje_encoder_init().
+typedef struct
+{
+    TJEColorFormat   format;
+    TJEQualityTables qt;
+    TJEState         state;
+    // Headers depend only on the above and the frame size, so they are serialised once per size.
+    int              header_width;
+    int              header_height;
+    size_t           header_len;
+    uint8_t          header[TJEI_MAX_HEADER_SIZE];
+} TJEEncoder;
+
 static const uint8_t tjei_default_qt_luma_from_spec[] =
 {
    16,11,10,16, 24, 40, 51, 61,
@@ -134,6 +298,18 @@ static const uint8_t tjei_zig_zag[64] =
     35, 36, 48, 49, 57, 58, 62, 63,
 };
 
+static const uint8_t tjei_natural_order[64] =
+{
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63,
+};
+
 static uint16_t tjei_be_word(const uint16_t native_word)
 {
     uint8_t bytes[2];
@@ -207,22 +383,33 @@ typedef struct
 } TJEScanHeader;
 #pragma pack(pop)
 
+// Make room in the output buffer. In direct mode the output does not fit: flag it and let
+// later writes land at the start of the buffer, the encode result is discarded.
+static void tjei_output_full(TJEState* state)
+{
+    if ( state->write_context.func ) {
+        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
+    } else {
+        state->output_overflow = 1;
+    }
+    state->output_buffer_count = 0;
+}
+
 static void tjei_write(TJEState* state, const void* data, size_t num_bytes, size_t num_elements)
 {
     size_t to_write = num_bytes * num_elements;
-    size_t capped_count = tjei_min(to_write, TJEI_BUFFER_SIZE - 1 - state->output_buffer_count);
+    size_t capped_count = tjei_min(to_write, state->output_buffer_size - state->output_buffer_count);
 
     memcpy(state->output_buffer + state->output_buffer_count, data, capped_count);
     state->output_buffer_count += capped_count;
 
-    assert (state->output_buffer_count <= TJEI_BUFFER_SIZE - 1);
-
-    if ( state->output_buffer_count == TJEI_BUFFER_SIZE - 1 ) {
-        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
-        state->output_buffer_count = 0;
-    }
+    assert (state->output_buffer_count <= state->output_buffer_size);
 
     if (capped_count < to_write) {
+        tjei_output_full(state);
+        if ( state->output_overflow ) {
+            return;
+        }
         tjei_write(state, (uint8_t*)data+capped_count, to_write - capped_count, 1);
     }
 }
@@ -308,8 +495,8 @@ static uint16_t* tjei_huff_get_codes(uint16_t codes[], uint8_t* huffsize, int64_
     }
 }
 
-static void tjei_huff_get_extended(uint8_t* out_ehuffsize,
-                                   uint16_t* out_ehuffcode,
+// Pack code and length of each symbol into one table entry.
+static void tjei_huff_get_extended(uint32_t* out_ehuff,
                                    uint8_t const * huffval,
                                    uint8_t* huffsize,
                                    uint16_t* huffcode, int64_t count)
@@ -318,46 +505,301 @@ static void tjei_huff_get_extended(uint8_t* out_ehuffsize,
     uint8_t val;
     do {
         val = huffval[k];
-        out_ehuffcode[val] = huffcode[k];
-        out_ehuffsize[val] = huffsize[k];
+        out_ehuff[val] = ((uint32_t)huffcode[k] << 8) | huffsize[k];
         k++;
     } while ( k < count );
 }
 
-static void tjei_calculate_variable_length_int(int value, uint16_t out[2])
+// Bits needed for x: the magnitude category of a coefficient |value|, 0 for 0.
+static int tjei_bit_length(uint32_t x)
+{
+#if defined(__GNUC__)
+    return x ? 32 - __builtin_clz(x) : 0;
+#else
+    int n = 0;
+
+    while ( x ) {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+// The size low bits of value that follow its category: one's complement for negative values.
+#define TJEI_VLI_BITS(value, size)  ((uint32_t)((value) - ((value) < 0)) & ((1u << (size)) - 1))
+
+// Write a full 64-bit accumulator, stuffing a zero byte after each 0xFF.
+static void tjei_flush_bits(TJEState* state, uint64_t bits)
 {
-    int abs_val = value;
-    if ( value < 0 ) {
-        abs_val = -abs_val;
-        --value;
+    uint8_t* out;
+    uint8_t c;
+    int i;
+
+    if ( state->output_buffer_count + 16 > state->output_buffer_size ) {
+        if ( state->write_context.func == NULL ) {
+            // Direct output near its end: go through the exact bounds checks of tjei_write().
+            for ( i = 0; i < 8; ++i ) {
+                c = (uint8_t)(bits >> (56 - 8 * i));
+                tjei_write(state, &c, 1, 1);
+                if ( c == 0xff ) {
+                    c = 0;
+                    tjei_write(state, &c, 1, 1);
+                }
+            }
+            return;
+        }
+        tjei_output_full(state);
+    }
+    out = state->output_buffer + state->output_buffer_count;
+
+    // Flags every 0xFF byte (and, harmlessly, some 0xFE ones).
+    if ( !(bits & 0x8080808080808080ull & ~(bits + 0x0101010101010101ull)) ) {
+        for ( i = 0; i < 8; ++i ) {
+            out[i] = (uint8_t)(bits >> (56 - 8 * i));
+        }
+        state->output_buffer_count += 8;
+        return;
     }
-    out[1] = 1;
-    while( abs_val >>= 1 ) {
-        ++out[1];
+    for ( i = 0; i < 8; ++i ) {
+        c = (uint8_t)(bits >> (56 - 8 * i));
+        *out++ = c;
+        if ( c == 0xff ) {
+            *out++ = 0;
+        }
     }
-    out[0] = (uint16_t)(value & ((1 << out[1]) - 1));
+    state->output_buffer_count = (size_t)(out - state->output_buffer);
 }
 
+// Append num_bits (1..32) bits. The accumulator holds 64 - *free_bits pending bits, right aligned;
+// once full it is flushed as eight bytes.
 static void tjei_write_bits(TJEState* state,
-                            uint32_t* bitbuffer, uint32_t* location,
-                            uint16_t num_bits, uint16_t bits)
+                            uint64_t* bitbuffer, int* free_bits,
+                            uint32_t num_bits, uint32_t bits)
+{
+    int f = *free_bits - (int)num_bits;
+
+    if ( f >= 0 ) {
+        *bitbuffer = (*bitbuffer << num_bits) | bits;
+    } else {
+        tjei_flush_bits(state, (*bitbuffer << (num_bits + f)) | (bits >> -f));
+        // Bits above the new pending ones were already written; they are shifted out later.
+        *bitbuffer = bits;
+        f += 64;
+    }
+    *free_bits = f;
+}
+
+// Pad the pending bits to a byte boundary with zeros and write them out.
+static void tjei_write_bits_final(TJEState* state, uint64_t* bitbuffer, int* free_bits)
 {
-    uint32_t nloc = *location + num_bits;
+    int pending = 64 - *free_bits;
     uint8_t c;
-    *bitbuffer |= (uint32_t)(bits << (32 - nloc));
-    *location = nloc;
-    while ( *location >= 8 ) {
-        c = (uint8_t)((*bitbuffer) >> 24);
+    char z = 0;
+
+    if ( pending & 7 ) {
+        tjei_write_bits(state, bitbuffer, free_bits, (uint32_t)(8 - (pending & 7)), 0);
+        pending = 64 - *free_bits;
+    }
+    while ( pending > 0 ) {
+        pending -= 8;
+        c = (uint8_t)(*bitbuffer >> pending);
         tjei_write(state, &c, 1, 1);
-        if ( c == 0xff )  {
-            char z = 0;
+        if ( c == 0xff ) {
             tjei_write(state, &z, 1, 1);
         }
-        *bitbuffer <<= 8;
-        *location -= 8;
+    }
+    *bitbuffer = 0;
+    *free_bits = 64;
+}
+
+#if TJE_FIXED_POINT
+#define TJEI_CONST_BITS  13
+#define TJEI_PASS1_BITS  2
+#define TJEI_DESCALE(x, n)  (((x) + (1 << ((n) - 1))) >> (n))
+
+#define TJEI_FIX_0_298631336  2446
+#define TJEI_FIX_0_390180644  3196
+#define TJEI_FIX_0_541196100  4433
+#define TJEI_FIX_0_765366865  6270
+#define TJEI_FIX_0_899976223  7373
+#define TJEI_FIX_1_175875602  9633
+#define TJEI_FIX_1_501321110  12299
+#define TJEI_FIX_1_847759065  15137
+#define TJEI_FIX_1_961570560  16069
+#define TJEI_FIX_2_053119869  16819
+#define TJEI_FIX_2_562915447  20995
+#define TJEI_FIX_3_072711026  25172
+
+// Loeffler-Ligtenberg-Moschytz integer FDCT (13-bit constants). Output is scaled up by 8.
+static void tjei_fdct (int32_t * data)
+{
+    int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    int32_t tmp10, tmp11, tmp12, tmp13;
+    int32_t z1, z2, z3, z4, z5;
+    int32_t *dataptr;
+    int ctr;
+
+    dataptr = data;
+    for ( ctr = 7; ctr >= 0; ctr-- ) {
+        tmp0 = dataptr[0] + dataptr[7];
+        tmp7 = dataptr[0] - dataptr[7];
+        tmp1 = dataptr[1] + dataptr[6];
+        tmp6 = dataptr[1] - dataptr[6];
+        tmp2 = dataptr[2] + dataptr[5];
+        tmp5 = dataptr[2] - dataptr[5];
+        tmp3 = dataptr[3] + dataptr[4];
+        tmp4 = dataptr[3] - dataptr[4];
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        dataptr[0] = (tmp10 + tmp11) << TJEI_PASS1_BITS;
+        dataptr[4] = (tmp10 - tmp11) << TJEI_PASS1_BITS;
+
+        z1 = (tmp12 + tmp13) * TJEI_FIX_0_541196100;
+        dataptr[2] = TJEI_DESCALE(z1 + tmp13 * TJEI_FIX_0_765366865, TJEI_CONST_BITS - TJEI_PASS1_BITS);
+        dataptr[6] = TJEI_DESCALE(z1 - tmp12 * TJEI_FIX_1_847759065, TJEI_CONST_BITS - TJEI_PASS1_BITS);
+
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * TJEI_FIX_1_175875602;
+
+        tmp4 *= TJEI_FIX_0_298631336;
+        tmp5 *= TJEI_FIX_2_053119869;
+        tmp6 *= TJEI_FIX_3_072711026;
+        tmp7 *= TJEI_FIX_1_501321110;
+        z1 *= -TJEI_FIX_0_899976223;
+        z2 *= -TJEI_FIX_2_562915447;
+        z3 *= -TJEI_FIX_1_961570560;
+        z4 *= -TJEI_FIX_0_390180644;
+
+        z3 += z5;
+        z4 += z5;
+
+        dataptr[7] = TJEI_DESCALE(tmp4 + z1 + z3, TJEI_CONST_BITS - TJEI_PASS1_BITS);
+        dataptr[5] = TJEI_DESCALE(tmp5 + z2 + z4, TJEI_CONST_BITS - TJEI_PASS1_BITS);
+        dataptr[3] = TJEI_DESCALE(tmp6 + z2 + z3, TJEI_CONST_BITS - TJEI_PASS1_BITS);
+        dataptr[1] = TJEI_DESCALE(tmp7 + z1 + z4, TJEI_CONST_BITS - TJEI_PASS1_BITS);
+
+        dataptr += 8;
+    }
+
+    dataptr = data;
+    for ( ctr = 7; ctr >= 0; ctr-- ) {
+        tmp0 = dataptr[8*0] + dataptr[8*7];
+        tmp7 = dataptr[8*0] - dataptr[8*7];
+        tmp1 = dataptr[8*1] + dataptr[8*6];
+        tmp6 = dataptr[8*1] - dataptr[8*6];
+        tmp2 = dataptr[8*2] + dataptr[8*5];
+        tmp5 = dataptr[8*2] - dataptr[8*5];
+        tmp3 = dataptr[8*3] + dataptr[8*4];
+        tmp4 = dataptr[8*3] - dataptr[8*4];
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        dataptr[8*0] = TJEI_DESCALE(tmp10 + tmp11, TJEI_PASS1_BITS);
+        dataptr[8*4] = TJEI_DESCALE(tmp10 - tmp11, TJEI_PASS1_BITS);
+
+        z1 = (tmp12 + tmp13) * TJEI_FIX_0_541196100;
+        dataptr[8*2] = TJEI_DESCALE(z1 + tmp13 * TJEI_FIX_0_765366865, TJEI_CONST_BITS + TJEI_PASS1_BITS);
+        dataptr[8*6] = TJEI_DESCALE(z1 - tmp12 * TJEI_FIX_1_847759065, TJEI_CONST_BITS + TJEI_PASS1_BITS);
+
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * TJEI_FIX_1_175875602;
+
+        tmp4 *= TJEI_FIX_0_298631336;
+        tmp5 *= TJEI_FIX_2_053119869;
+        tmp6 *= TJEI_FIX_3_072711026;
+        tmp7 *= TJEI_FIX_1_501321110;
+        z1 *= -TJEI_FIX_0_899976223;
+        z2 *= -TJEI_FIX_2_562915447;
+        z3 *= -TJEI_FIX_1_961570560;
+        z4 *= -TJEI_FIX_0_390180644;
+
+        z3 += z5;
+        z4 += z5;
+
+        dataptr[8*7] = TJEI_DESCALE(tmp4 + z1 + z3, TJEI_CONST_BITS + TJEI_PASS1_BITS);
+        dataptr[8*5] = TJEI_DESCALE(tmp5 + z2 + z4, TJEI_CONST_BITS + TJEI_PASS1_BITS);
+        dataptr[8*3] = TJEI_DESCALE(tmp6 + z2 + z3, TJEI_CONST_BITS + TJEI_PASS1_BITS);
+        dataptr[8*1] = TJEI_DESCALE(tmp7 + z1 + z4, TJEI_CONST_BITS + TJEI_PASS1_BITS);
+
+        dataptr++;
+    }
+}
+
+// 16-bit reciprocal of the divisor, exact for |x| < 2^15 (same scheme as libjpeg-turbo).
+static void tjei_compute_reciprocal(TJEQuant* quant, int i, uint16_t divisor)
+{
+    uint32_t fq, fr;
+    uint16_t c;
+    int b, r;
+
+    assert(divisor >= 2);
+    b = 0;
+    while ( (divisor >> (b + 1)) != 0 ) {
+        ++b;
+    }
+    r  = 16 + b;
+    fq = ((uint32_t)1 << r) / divisor;
+    fr = ((uint32_t)1 << r) % divisor;
+    c  = (uint16_t)(divisor / 2);
+    if ( fr == 0 ) {
+        fq >>= 1;
+        --r;
+    } else if ( fr <= (divisor / 2U) ) {
+        ++c;
+    } else {
+        ++fq;
+    }
+    quant->recip[i] = (uint16_t)fq;
+    quant->corr[i]  = c;
+    quant->shift[i] = (uint16_t)(r - 16);
+    quant->scale[i] = (uint16_t)(1 << (32 - r));
+}
+
+// Transform only, raster order. Outputs of 8-bit samples fit 16 bits.
+static void tjei_fdct_block(const TJESample* mcu, TJESample dct[64])
+{
+    int32_t dct_mcu[64];
+    int i;
+
+    for ( i = 0; i < 64; ++i ) {
+        dct_mcu[i] = mcu[i];
+    }
+    tjei_fdct(dct_mcu);
+    for ( i = 0; i < 64; ++i ) {
+        dct[i] = (TJESample)dct_mcu[i];
     }
 }
 
+// Quantised coefficients are produced in zig-zag order.
+static void tjei_quantize(const TJESample dct[64], const TJEQuant* qt, int16_t du[64])
+{
+    uint32_t product;
+    int i, n;
+    int val;
+
+    for ( i = 0; i < 64; ++i ) {
+        n = tjei_natural_order[i];
+        val = dct[n];
+        product = (uint32_t)(ABS(val) + qt->corr[n]) * qt->recip[n];
+        product >>= 16 + qt->shift[n];
+        du[i] = (int16_t)(val < 0 ? -(int)product : (int)product);
+    }
+}
+#else
 static void tjei_fdct (float * data)
 {
     float tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
@@ -453,405 +895,2837 @@ static void tjei_fdct (float * data)
     }
 }
 
-static void tjei_encode_and_write_MCU(TJEState* state,
-                                      float* mcu,
-                                      float* qt,  // Pre-processed quantization matrix.
-                                      uint8_t* huff_dc_len, uint16_t* huff_dc_code, // Huffman tables
-                                      uint8_t* huff_ac_len, uint16_t* huff_ac_code,
-                                      int* pred,  // Previous DC coefficient
-                                      uint32_t* bitbuffer,  // Bitstack.
-                                      uint32_t* location)
+// Quantised coefficients are produced in zig-zag order.
+static void tjei_fdct_block(const TJESample* mcu, TJESample dct[64])
 {
-    int du[64];
-    float dct_mcu[64];
-    int i;
-    float fval;
-    int val;
-    uint16_t vli[2];
-    int diff;
-    int last_non_zero_i = 0;
-    int zero_count = 0;
-    uint16_t sym1;
+    memcpy(dct, mcu, 64 * sizeof(float));
+    tjei_fdct(dct);
+}
 
-    memcpy(dct_mcu, mcu, 64 * sizeof(float));
+static void tjei_quantize(const TJESample dct[64], const TJEQuant* qt, int16_t du[64])
+{
+    float fval;
+    int i, n;
 
-    tjei_fdct(dct_mcu);
     for ( i = 0; i < 64; ++i ) {
-        fval = dct_mcu[i];
-        fval *= qt[i];
+        n = tjei_natural_order[i];
+        fval = dct[n];
+        fval *= qt->recip[n];
         fval = floorf(fval + 1024 + 0.5f);
         fval -= 1024;
-        val = (int)fval;
-        du[tjei_zig_zag[i]] = val;
+        du[i] = (int16_t)fval;
     }
+}
+#endif
 
-    diff = du[0] - *pred;
-    *pred = du[0];
-    if ( diff != 0 ) {
-        tjei_calculate_variable_length_int(diff, vli);
-        tjei_write_bits(state, bitbuffer, location, huff_dc_len[vli[1]], huff_dc_code[vli[1]]);
-        tjei_write_bits(state, bitbuffer, location, vli[1], vli[0]);
-    } else {
-        tjei_write_bits(state, bitbuffer, location, huff_dc_len[0], huff_dc_code[0]);
-    }
+static void tjei_fdct_quantize(const TJESample* mcu, const TJEQuant* qt, int16_t du[64])
+{
+    TJESample dct[64];
 
-    for ( i = 63; i > 0; --i ) {
-        if (du[i] != 0) {
-            last_non_zero_i = i;
-            break;
-        }
-    }
+    tjei_fdct_block(mcu, dct);
+    tjei_quantize(dct, qt, du);
+}
 
-    for ( i = 1; i <= last_non_zero_i; ++i ) {
-        zero_count = 0;
-        while ( du[i] == 0 ) {
-            ++zero_count;
-            ++i;
-            if (zero_count == 16) {
-                tjei_write_bits(state, bitbuffer, location, huff_ac_len[0xf0], huff_ac_code[0xf0]);
-                zero_count = 0;
-            }
-        }
-        tjei_calculate_variable_length_int(du[i], vli);
+#if TJEI_SIMD_X86 && TJE_FIXED_POINT
+#define TJEI_PW(a, b)  _mm_setr_epi16((a), (b), (a), (b), (a), (b), (a), (b))
 
-        assert(zero_count < 0x10);
-        assert(vli[1] <= 10);
+// Zig-zag reorder by byte shuffles: output register k gathers zig-zag entries 8k..8k+7
+// from the quantised raster rows. Filled by tjei_simd_init().
+static uint8_t tjei_zz_shuffle[36][16];
+static uint8_t tjei_zz_pairs[36][2];    // { output register, source row }
 
-        sym1 = (uint16_t)((uint16_t)zero_count << 4) | vli[1];
+static void tjei_transpose_sse2(__m128i d[8])
+{
+    __m128i a0, a1, a2, a3, a4, a5, a6, a7;
+    __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+
+    a0 = _mm_unpacklo_epi16(d[0], d[1]);
+    a1 = _mm_unpackhi_epi16(d[0], d[1]);
+    a2 = _mm_unpacklo_epi16(d[2], d[3]);
+    a3 = _mm_unpackhi_epi16(d[2], d[3]);
+    a4 = _mm_unpacklo_epi16(d[4], d[5]);
+    a5 = _mm_unpackhi_epi16(d[4], d[5]);
+    a6 = _mm_unpacklo_epi16(d[6], d[7]);
+    a7 = _mm_unpackhi_epi16(d[6], d[7]);
+
+    b0 = _mm_unpacklo_epi32(a0, a2);
+    b1 = _mm_unpackhi_epi32(a0, a2);
+    b2 = _mm_unpacklo_epi32(a1, a3);
+    b3 = _mm_unpackhi_epi32(a1, a3);
+    b4 = _mm_unpacklo_epi32(a4, a6);
+    b5 = _mm_unpackhi_epi32(a4, a6);
+    b6 = _mm_unpacklo_epi32(a5, a7);
+    b7 = _mm_unpackhi_epi32(a5, a7);
+
+    d[0] = _mm_unpacklo_epi64(b0, b4);
+    d[1] = _mm_unpackhi_epi64(b0, b4);
+    d[2] = _mm_unpacklo_epi64(b1, b5);
+    d[3] = _mm_unpackhi_epi64(b1, b5);
+    d[4] = _mm_unpacklo_epi64(b2, b6);
+    d[5] = _mm_unpackhi_epi64(b2, b6);
+    d[6] = _mm_unpacklo_epi64(b3, b7);
+    d[7] = _mm_unpackhi_epi64(b3, b7);
+}
 
-        assert(huff_ac_len[sym1] != 0);
+static __m128i tjei_descale_pack_sse2(__m128i lo, __m128i hi, __m128i round, int n)
+{
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, round), n);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, round), n);
+    return _mm_packs_epi32(lo, hi);
+}
 
-        tjei_write_bits(state, bitbuffer, location, huff_ac_len[sym1], huff_ac_code[sym1]);
-        tjei_write_bits(state, bitbuffer, location, vli[1], vli[0]);
+// One 1-D pass of the islow FDCT on eight vectors at once; bit-exact with tjei_fdct() for samples
+// in [-128, 127]. The pass 2 DC / even sums are 16 bits wide and a block of +128 would wrap them.
+static void tjei_fdct_pass_sse2(__m128i d[8], int pass1)
+{
+    __m128i tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    __m128i tmp10, tmp11, tmp12, tmp13;
+    __m128i lo, hi, c, z3lo, z3hi, z4lo, z4hi, round;
+    const int n = pass1 ? TJEI_CONST_BITS - TJEI_PASS1_BITS : TJEI_CONST_BITS + TJEI_PASS1_BITS;
+
+    round = _mm_set1_epi32(1 << (n - 1));
+
+    tmp0 = _mm_add_epi16(d[0], d[7]);
+    tmp7 = _mm_sub_epi16(d[0], d[7]);
+    tmp1 = _mm_add_epi16(d[1], d[6]);
+    tmp6 = _mm_sub_epi16(d[1], d[6]);
+    tmp2 = _mm_add_epi16(d[2], d[5]);
+    tmp5 = _mm_sub_epi16(d[2], d[5]);
+    tmp3 = _mm_add_epi16(d[3], d[4]);
+    tmp4 = _mm_sub_epi16(d[3], d[4]);
+
+    tmp10 = _mm_add_epi16(tmp0, tmp3);
+    tmp13 = _mm_sub_epi16(tmp0, tmp3);
+    tmp11 = _mm_add_epi16(tmp1, tmp2);
+    tmp12 = _mm_sub_epi16(tmp1, tmp2);
+
+    if ( pass1 ) {
+        d[0] = _mm_slli_epi16(_mm_add_epi16(tmp10, tmp11), TJEI_PASS1_BITS);
+        d[4] = _mm_slli_epi16(_mm_sub_epi16(tmp10, tmp11), TJEI_PASS1_BITS);
+    } else {
+        __m128i r = _mm_set1_epi16(1 << (TJEI_PASS1_BITS - 1));
+        d[0] = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(tmp10, tmp11), r), TJEI_PASS1_BITS);
+        d[4] = _mm_srai_epi16(_mm_add_epi16(_mm_sub_epi16(tmp10, tmp11), r), TJEI_PASS1_BITS);
     }
 
-    if (last_non_zero_i != 63) {
-        tjei_write_bits(state, bitbuffer, location, huff_ac_len[0], huff_ac_code[0]);
-    }
-    return;
+    // Even part: z1 = (tmp12 + tmp13) * c folded into one rotation of (tmp13, tmp12).
+    lo = _mm_unpacklo_epi16(tmp13, tmp12);
+    hi = _mm_unpackhi_epi16(tmp13, tmp12);
+    c  = TJEI_PW(TJEI_FIX_0_541196100 + TJEI_FIX_0_765366865, TJEI_FIX_0_541196100);
+    d[2] = tjei_descale_pack_sse2(_mm_madd_epi16(lo, c), _mm_madd_epi16(hi, c), round, n);
+    c  = TJEI_PW(TJEI_FIX_0_541196100, TJEI_FIX_0_541196100 - TJEI_FIX_1_847759065);
+    d[6] = tjei_descale_pack_sse2(_mm_madd_epi16(lo, c), _mm_madd_epi16(hi, c), round, n);
+
+    // Odd part: z5 distributed over z3 = tmp4 + tmp6 and z4 = tmp5 + tmp7.
+    lo = _mm_unpacklo_epi16(_mm_add_epi16(tmp4, tmp6), _mm_add_epi16(tmp5, tmp7));
+    hi = _mm_unpackhi_epi16(_mm_add_epi16(tmp4, tmp6), _mm_add_epi16(tmp5, tmp7));
+    c  = TJEI_PW(TJEI_FIX_1_175875602 - TJEI_FIX_1_961570560, TJEI_FIX_1_175875602);
+    z3lo = _mm_madd_epi16(lo, c);
+    z3hi = _mm_madd_epi16(hi, c);
+    c  = TJEI_PW(TJEI_FIX_1_175875602, TJEI_FIX_1_175875602 - TJEI_FIX_0_390180644);
+    z4lo = _mm_madd_epi16(lo, c);
+    z4hi = _mm_madd_epi16(hi, c);
+
+    // z1 = tmp4 + tmp7 folded into the (tmp4, tmp7) rotations.
+    lo = _mm_unpacklo_epi16(tmp4, tmp7);
+    hi = _mm_unpackhi_epi16(tmp4, tmp7);
+    c  = TJEI_PW(TJEI_FIX_0_298631336 - TJEI_FIX_0_899976223, -TJEI_FIX_0_899976223);
+    d[7] = tjei_descale_pack_sse2(_mm_add_epi32(_mm_madd_epi16(lo, c), z3lo), _mm_add_epi32(_mm_madd_epi16(hi, c), z3hi), round, n);
+    c  = TJEI_PW(-TJEI_FIX_0_899976223, TJEI_FIX_1_501321110 - TJEI_FIX_0_899976223);
+    d[1] = tjei_descale_pack_sse2(_mm_add_epi32(_mm_madd_epi16(lo, c), z4lo), _mm_add_epi32(_mm_madd_epi16(hi, c), z4hi), round, n);
+
+    // z2 = tmp5 + tmp6 folded into the (tmp5, tmp6) rotations.
+    lo = _mm_unpacklo_epi16(tmp5, tmp6);
+    hi = _mm_unpackhi_epi16(tmp5, tmp6);
+    c  = TJEI_PW(TJEI_FIX_2_053119869 - TJEI_FIX_2_562915447, -TJEI_FIX_2_562915447);
+    d[5] = tjei_descale_pack_sse2(_mm_add_epi32(_mm_madd_epi16(lo, c), z4lo), _mm_add_epi32(_mm_madd_epi16(hi, c), z4hi), round, n);
+    c  = TJEI_PW(-TJEI_FIX_2_562915447, TJEI_FIX_3_072711026 - TJEI_FIX_2_562915447);
+    d[3] = tjei_descale_pack_sse2(_mm_add_epi32(_mm_madd_epi16(lo, c), z3lo), _mm_add_epi32(_mm_madd_epi16(hi, c), z3hi), round, n);
 }
 
-static void tjei_huff_expand(TJEState* state)
+// FDCT and quantisation of one block into eight raster rows.
+static void tjei_fdct_rows_sse2(const TJESample* mcu, __m128i q[8])
 {
-    int32_t spec_tables_len[4] = { 0 };
-    int i, k;
-    uint8_t huffsize[4][257];
-    uint16_t huffcode[4][256];
-    int64_t count;
-
-    assert(state);
+    int i;
 
-    state->ht_bits[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc_len;
-    state->ht_bits[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac_len;
-    state->ht_bits[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc_len;
-    state->ht_bits[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac_len;
+    for ( i = 0; i < 8; ++i ) {
+        q[i] = _mm_loadu_si128((const __m128i*)(mcu + i * 8));
+    }
+    tjei_transpose_sse2(q);
+    tjei_fdct_pass_sse2(q, 1);
+    tjei_transpose_sse2(q);
+    tjei_fdct_pass_sse2(q, 0);
+}
 
-    state->ht_vals[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc;
-    state->ht_vals[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac;
-    state->ht_vals[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc;
-    state->ht_vals[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac;
+static void tjei_quantize_rows_sse2(__m128i q[8], const TJEQuant* qt)
+{
+    __m128i sign, a;
+    int i;
 
-    for ( i = 0; i < 4; ++i ) {
-        for ( k = 0; k < 16; ++k ) {
-            spec_tables_len[i] += state->ht_bits[i][k];
-        }
+    for ( i = 0; i < 8; ++i ) {
+        sign = _mm_srai_epi16(q[i], 15);
+        a = _mm_sub_epi16(_mm_xor_si128(q[i], sign), sign);
+        a = _mm_add_epi16(a, _mm_loadu_si128((const __m128i*)(qt->corr + i * 8)));
+        a = _mm_mulhi_epu16(a, _mm_loadu_si128((const __m128i*)(qt->recip + i * 8)));
+        a = _mm_mulhi_epu16(a, _mm_loadu_si128((const __m128i*)(qt->scale + i * 8)));
+        q[i] = _mm_sub_epi16(_mm_xor_si128(a, sign), sign);
     }
+}
 
-    for ( i = 0; i < 4; ++i ) {
-        assert (256 >= spec_tables_len[i]);
-        tjei_huff_get_code_lengths(huffsize[i], state->ht_bits[i]);
-        tjei_huff_get_codes(huffcode[i], huffsize[i], spec_tables_len[i]);
-    }
+static void tjei_store_zigzag_sse2(const __m128i q[8], int16_t du[64])
+{
+    int16_t raster[64];
+    int i;
 
-    for ( i = 0; i < 4; ++i ) {
-        count = spec_tables_len[i];
-        tjei_huff_get_extended(state->ehuffsize[i],
-                               state->ehuffcode[i],
-                               state->ht_vals[i],
-                               &huffsize[i][0],
-                               &huffcode[i][0], count);
+    for ( i = 0; i < 8; ++i ) {
+        _mm_storeu_si128((__m128i*)(raster + i * 8), q[i]);
+    }
+    for ( i = 0; i < 64; ++i ) {
+        du[i] = raster[tjei_natural_order[i]];
     }
 }
 
-static int tjei_encode_main(TJEState* state,
-                            const unsigned char* src_data,
-                            const int width,
-                            const int height,
-                            TJEColorFormat color_format)
+__attribute__((target("ssse3")))
+static void tjei_store_zigzag_ssse3(const __m128i q[8], int16_t du[64])
 {
-    struct TJEProcessedQT pqt;
-    static const float aan_scales[] = { 1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f };
-    int x, y, i;
-    TJEJPEGHeader header;
-    uint16_t jfif_len;
-    TJEJPEGComment com;
-    uint16_t com_len;
-    TJEFrameHeader frame_header;
-    TJEComponentSpec spec;
-    uint8_t tables[3] = { 0, 1, 1};
-    TJEScanHeader scan_header;
-    uint8_t scan_tables[3] = { 0x00, 0x11, 0x11 };
-    TJEFrameComponentSpec cs;
-    uint32_t bitbuffer = 0;
-    uint32_t location = 0;
-    float du_y[64];
-    float du_b[64];
-    float du_r[64];
-    int pred_y = 0;
-    int pred_b = 0;
-    int pred_r = 0;
-    int off_y, off_x;
-    int block_index, src_index;
-    int col, row;
-    uint8_t r,g,b;
-    uint16_t rgb;
-    float luma, cb, cr;
-    uint16_t EOI;
+    __m128i zz[8];
+    int i;
 
-    if (color_format < 2 || color_format > 4) {
-        return 0;
+    for ( i = 0; i < 8; ++i ) {
+        zz[i] = _mm_setzero_si128();
     }
-
-    if (width > 0xffff || height > 0xffff) {
-        return 0;
+    for ( i = 0; i < 36; ++i ) {
+        zz[tjei_zz_pairs[i][0]] = _mm_or_si128(zz[tjei_zz_pairs[i][0]],
+                                               _mm_shuffle_epi8(q[tjei_zz_pairs[i][1]],
+                                                                _mm_loadu_si128((const __m128i*)tjei_zz_shuffle[i])));
     }
-
-    for(y=0; y<8; y++) {
-        for(x=0; x<8; x++) {
-            i = y*8 + x;
-            pqt.luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[tjei_zig_zag[i]]);
-            pqt.chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[tjei_zig_zag[i]]);
-        }
+    for ( i = 0; i < 8; ++i ) {
+        _mm_storeu_si128((__m128i*)(du + i * 8), zz[i]);
     }
+}
 
-    {
-        header.SOI = tjei_be_word(0xffd8);  // Sequential DCT
-        header.APP0 = tjei_be_word(0xffe0);
+static void tjei_fdct_quantize_sse2(const TJESample* mcu, const TJEQuant* qt, int16_t du[64])
+{
+    __m128i q[8];
 
-        jfif_len = sizeof(TJEJPEGHeader) - 4 /*SOI & APP0 markers*/;
-        header.jfif_len = tjei_be_word(jfif_len);
-        memcpy(header.jfif_id, (void*)tjeik_jfif_id, 5);
-        header.version = tjei_be_word(0x0102);
-        header.units = 0x01;  // Dots-per-inch
-        header.x_density = tjei_be_word(0x0060);  // 96 DPI
-        header.y_density = tjei_be_word(0x0060);  // 96 DPI
-        header.x_thumb = 0;
-        header.y_thumb = 0;
-        tjei_write(state, &header, sizeof(TJEJPEGHeader), 1);
+    tjei_fdct_rows_sse2(mcu, q);
+    tjei_quantize_rows_sse2(q, qt);
+    tjei_store_zigzag_sse2(q, du);
+}
+
+__attribute__((target("ssse3")))
+static void tjei_fdct_quantize_ssse3(const TJESample* mcu, const TJEQuant* qt, int16_t du[64])
+{
+    __m128i q[8];
+
+    tjei_fdct_rows_sse2(mcu, q);
+    tjei_quantize_rows_sse2(q, qt);
+    tjei_store_zigzag_ssse3(q, du);
+}
+
+static void tjei_fdct_sse2(const TJESample* mcu, TJESample dct[64])
+{
+    __m128i q[8];
+    int i;
+
+    tjei_fdct_rows_sse2(mcu, q);
+    for ( i = 0; i < 8; ++i ) {
+        _mm_storeu_si128((__m128i*)(dct + i * 8), q[i]);
     }
+}
 
-    {
-        com_len = 2 + sizeof(tjeik_com_str) - 1;
-        com.com = tjei_be_word(0xfffe);
-        com.com_len = tjei_be_word(com_len);
-        memcpy(com.com_str, (void*)tjeik_com_str, sizeof(tjeik_com_str)-1);
-        tjei_write(state, &com, sizeof(TJEJPEGComment), 1);
+static void tjei_quantize_sse2(const TJESample dct[64], const TJEQuant* qt, int16_t du[64])
+{
+    __m128i q[8];
+    int i;
+
+    for ( i = 0; i < 8; ++i ) {
+        q[i] = _mm_loadu_si128((const __m128i*)(dct + i * 8));
     }
+    tjei_quantize_rows_sse2(q, qt);
+    tjei_store_zigzag_sse2(q, du);
+}
 
-    tjei_write_DQT(state, state->qt_luma, 0x00);
-    tjei_write_DQT(state, state->qt_chroma, 0x01);
+__attribute__((target("ssse3")))
+static void tjei_quantize_ssse3(const TJESample dct[64], const TJEQuant* qt, int16_t du[64])
+{
+    __m128i q[8];
+    int i;
 
-    {
-        frame_header.SOF = tjei_be_word(0xffc0);
-        frame_header.len = tjei_be_word(8 + 3 * 3);
-        frame_header.precision = 8;
-        assert(width <= 0xffff);
-        assert(height <= 0xffff);
-        frame_header.width = tjei_be_word((uint16_t)width);
-        frame_header.height = tjei_be_word((uint16_t)height);
-        frame_header.num_components = 3;
+    for ( i = 0; i < 8; ++i ) {
+        q[i] = _mm_loadu_si128((const __m128i*)(dct + i * 8));
+    }
+    tjei_quantize_rows_sse2(q, qt);
+    tjei_store_zigzag_ssse3(q, du);
+}
+#endif
 
-        for (i = 0; i < 3; ++i) {
-            spec.component_id = (uint8_t)(i + 1);  // No particular reason. Just 1, 2, 3.
-            spec.sampling_factors = (uint8_t)0x11;
-            spec.qt = tables[i];
+static TJESample tjei_rgb_to_y(int r, int g, int b)
+{
+#if TJE_FIXED_POINT
+    return (TJESample)(((19595 * r + 38470 * g + 7471 * b + 32768) >> 16) - 128);
+#else
+    return 0.299f * r + 0.587f * g + 0.114f * b - 128;
+#endif
+}
 
-            frame_header.component_spec[i] = spec;
+static void tjei_rgb_to_ycc(int r, int g, int b, TJESample* y, TJESample* cb, TJESample* cr)
+{
+    *y  = tjei_rgb_to_y(r, g, b);
+#if TJE_FIXED_POINT
+    // Rounding with ONE_HALF - 1 as libjpeg does keeps Cb / Cr of 255 at 127: the transforms
+    // need level-shifted samples in [-128, 127].
+    *cb = (TJESample)((-11059 * r - 21709 * g + 32768 * b + 32767) >> 16);
+    *cr = (TJESample)((32768 * r - 27439 * g - 5329 * b + 32767) >> 16);
+#else
+    *cb = -0.1687f * r - 0.3313f   * g + 0.5f      * b;
+    *cr = 0.5f     * r - 0.4187f   * g - 0.0813f   * b;
+#endif
+}
+
+// Colour conversion of one 8-pixel row segment into the Y/Cb/Cr block rows.
+static void tjei_color_row_rgb565(const uint8_t* src, TJESample* y, TJESample* cb, TJESample* cr)
+{
+    uint16_t rgb;
+    int i;
+
+    for ( i = 0; i < 8; ++i ) {
+        rgb = (uint16_t)(src[2 * i + 1] << CHAR_BIT | src[2 * i + 0]);
+        if ( cb ) {
+            tjei_rgb_to_ycc((rgb & 0x001F) << 3, (rgb & 0x07E0) >> 3, (rgb & 0xF800) >> 8, y + i, cb + i, cr + i);
+        } else {
+            y[i] = tjei_rgb_to_y((rgb & 0x001F) << 3, (rgb & 0x07E0) >> 3, (rgb & 0xF800) >> 8);
         }
-        tjei_write(state, &frame_header, sizeof(TJEFrameHeader), 1);
     }
+}
 
-    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_DC],   state->ht_vals[TJEI_LUMA_DC], TJEI_DC, 0);
-    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_AC],   state->ht_vals[TJEI_LUMA_AC], TJEI_AC, 0);
-    tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_DC], state->ht_vals[TJEI_CHROMA_DC], TJEI_DC, 1);
-    tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_AC], state->ht_vals[TJEI_CHROMA_AC], TJEI_AC, 1);
+static void tjei_color_row_rgb888(const uint8_t* src, TJESample* y, TJESample* cb, TJESample* cr)
+{
+    int i;
 
-    {
-        scan_header.SOS = tjei_be_word(0xffda);
-        scan_header.len = tjei_be_word((uint16_t)(6 + (sizeof(TJEFrameComponentSpec) * 3)));
-        scan_header.num_components = 3;
+    for ( i = 0; i < 8; ++i ) {
+        if ( cb ) {
+            tjei_rgb_to_ycc(src[3 * i + 0], src[3 * i + 1], src[3 * i + 2], y + i, cb + i, cr + i);
+        } else {
+            y[i] = tjei_rgb_to_y(src[3 * i + 0], src[3 * i + 1], src[3 * i + 2]);
+        }
+    }
+}
 
-        for (i = 0; i < 3; ++i) {
-            cs.component_id = (uint8_t)(i + 1);
-            cs.dc_ac = (uint8_t)scan_tables[i];
-            scan_header.component_spec[i] = cs;
+static void tjei_color_row_rgba(const uint8_t* src, TJESample* y, TJESample* cb, TJESample* cr)
+{
+    int i;
+
+    for ( i = 0; i < 8; ++i ) {
+        if ( cb ) {
+            tjei_rgb_to_ycc(src[4 * i + 0], src[4 * i + 1], src[4 * i + 2], y + i, cb + i, cr + i);
+        } else {
+            y[i] = tjei_rgb_to_y(src[4 * i + 0], src[4 * i + 1], src[4 * i + 2]);
         }
+    }
+}
 
-        scan_header.first = 0;
-        scan_header.last  = 63;
-        scan_header.ah_al = 0;
-        tjei_write(state, &scan_header, sizeof(TJEScanHeader), 1);
+#if TJEI_SIMD_X86 && TJE_FIXED_POINT
+// 32-bit products of the pairs (a, b) with (ca, cb) plus (c, d) with (cc, cd), rounded, >> 16 and packed.
+static __m128i tjei_ycc_dot_sse2(__m128i ab, __m128i cd, __m128i ab_hi, __m128i cd_hi, __m128i k0, __m128i k1,
+                                 int round_bias)
+{
+    const __m128i round = _mm_set1_epi32(round_bias);
+    __m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(ab, k0), _mm_madd_epi16(cd, k1)), round);
+    __m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(ab_hi, k0), _mm_madd_epi16(cd_hi, k1)), round);
+    return _mm_packs_epi32(_mm_srai_epi32(lo, 16), _mm_srai_epi32(hi, 16));
+}
+
+// Same arithmetic as tjei_rgb_to_ycc(); 16-bit constants that do not fit are split over two lanes.
+static void tjei_ycc_sse2(__m128i r, __m128i g, __m128i b, TJESample* y, TJESample* cb, TJESample* cr)
+{
+    __m128i rg = _mm_unpacklo_epi16(r, g), rg_hi = _mm_unpackhi_epi16(r, g);
+    __m128i gb = _mm_unpacklo_epi16(g, b), gb_hi = _mm_unpackhi_epi16(g, b);
+    __m128i rr, rr_hi, bb, bb_hi;
+
+    _mm_storeu_si128((__m128i*)y, _mm_sub_epi16(tjei_ycc_dot_sse2(rg, gb, rg_hi, gb_hi,
+                                                                  TJEI_PW(19595, 19235), TJEI_PW(19235, 7471), 32768),
+                                                _mm_set1_epi16(128)));
+    if ( cb == NULL ) {
+        return;
     }
+    rr = _mm_unpacklo_epi16(r, r);
+    rr_hi = _mm_unpackhi_epi16(r, r);
+    bb = _mm_unpacklo_epi16(b, b);
+    bb_hi = _mm_unpackhi_epi16(b, b);
+    _mm_storeu_si128((__m128i*)cb, tjei_ycc_dot_sse2(rg, bb, rg_hi, bb_hi,
+                                                     TJEI_PW(-11059, -21709), TJEI_PW(16384, 16384), 32767));
+    _mm_storeu_si128((__m128i*)cr, tjei_ycc_dot_sse2(rr, gb, rr_hi, gb_hi,
+                                                     TJEI_PW(16384, 16384), TJEI_PW(-27439, -5329), 32767));
+}
 
-    for ( y = 0; y < height; y += 8 ) {
-        for ( x = 0; x < width; x += 8 ) {
-            for ( off_y = 0; off_y < 8; ++off_y ) {
-                for ( off_x = 0; off_x < 8; ++off_x ) {
-                    block_index = (off_y * 8 + off_x);
-                    src_index = (((y + off_y) * width) + (x + off_x)) * color_format;
+static void tjei_color_row_rgb565_sse2(const uint8_t* src, TJESample* y, TJESample* cb, TJESample* cr)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)src);
+    __m128i r = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x001F)), 3);
+    __m128i g = _mm_srli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x07E0)), 3);
+    __m128i b = _mm_srli_epi16(v, 8);
 
-                    col = x + off_x;
-                    row = y + off_y;
+    tjei_ycc_sse2(r, g, _mm_and_si128(b, _mm_set1_epi16(0x00F8)), y, cb, cr);
+}
 
-                    if(row >= height) {
-                        src_index -= (width * (row - height + 1)) * color_format;
-                    }
-                    if(col >= width) {
-                        src_index -= (col - width + 1) * color_format;
-                    }
-                    assert(src_index < width * height * color_format);
-
-                    switch (color_format)
-                    {
-                    case TJE_RGBA:
-                        r = src_data[src_index + 0];
-                        g = src_data[src_index + 1];
-                        b = src_data[src_index + 2];
-                        break;
-                    case TJE_RGB888:
-                        r = src_data[src_index + 0];
-                        g = src_data[src_index + 1];
-                        b = src_data[src_index + 2];
-                        break;
-                    case TJE_RGB565:
-                        rgb = (src_data[src_index + 1] << CHAR_BIT | src_data[src_index + 0]);
-                        r = (rgb & 0x001F) << 3;
-                        g = (rgb & 0x07E0) >> 3;
-                        b = (rgb & 0xF800) >> 8;
-                        break;
-                    }
-                    
-                    luma = 0.299f   * r + 0.587f    * g + 0.114f    * b - 128;
-                    cb   = -0.1687f * r - 0.3313f   * g + 0.5f      * b;
-                    cr   = 0.5f     * r - 0.4187f   * g - 0.0813f   * b;
-
-                    du_y[block_index] = luma;
-                    du_b[block_index] = cb;
-                    du_r[block_index] = cr;
-                }
+static void tjei_color_row_rgba_sse2(const uint8_t* src, TJESample* y, TJESample* cb, TJESample* cr)
+{
+    const __m128i m = _mm_set1_epi32(0xFF);
+    __m128i v0 = _mm_loadu_si128((const __m128i*)src);
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(src + 16));
+    __m128i r = _mm_packs_epi32(_mm_and_si128(v0, m), _mm_and_si128(v1, m));
+    __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v0, 8), m), _mm_and_si128(_mm_srli_epi32(v1, 8), m));
+    __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v0, 16), m), _mm_and_si128(_mm_srli_epi32(v1, 16), m));
+
+    tjei_ycc_sse2(r, g, b, y, cb, cr);
+}
+
+__attribute__((target("ssse3")))
+static void tjei_color_row_rgb888_ssse3(const uint8_t* src, TJESample* y, TJESample* cb, TJESample* cr)
+{
+    // Bytes 0..15 and 16..23; each channel lands in the low byte of a 16-bit lane.
+    __m128i lo = _mm_loadu_si128((const __m128i*)src);
+    __m128i hi = _mm_loadl_epi64((const __m128i*)(src + 16));
+    const char z = (char)0x80;
+    __m128i r = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(0, z, 3, z, 6, z, 9, z, 12, z, 15, z, z, z, z, z)),
+                             _mm_shuffle_epi8(hi, _mm_setr_epi8(z, z, z, z, z, z, z, z, z, z, z, z, 2, z, 5, z)));
+    __m128i g = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(1, z, 4, z, 7, z, 10, z, 13, z, z, z, z, z, z, z)),
+                             _mm_shuffle_epi8(hi, _mm_setr_epi8(z, z, z, z, z, z, z, z, z, z, 0, z, 3, z, 6, z)));
+    __m128i b = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(2, z, 5, z, 8, z, 11, z, 14, z, z, z, z, z, z, z)),
+                             _mm_shuffle_epi8(hi, _mm_setr_epi8(z, z, z, z, z, z, z, z, z, z, 1, z, 4, z, 7, z)));
+
+    tjei_ycc_sse2(r, g, b, y, cb, cr);
+}
+#endif
+
+// Average a (8 * v_samp) x 16 chroma area (row pitch 16) down to one 8x8 block.
+// Rounding bias alternates between columns as in libjpeg's h2v1/h2v2 downsamplers.
+static void tjei_downsample(const TJESample* src, TJESample* dst, int v_samp)
+{
+    int r, c;
+    for ( r = 0; r < 8; ++r ) {
+        const TJESample* s0 = src + r * v_samp * 16;
+        const TJESample* s1 = s0 + (v_samp - 1) * 16;
+        for ( c = 0; c < 8; ++c ) {
+#if TJE_FIXED_POINT
+            if ( v_samp == 2 ) {
+                dst[r * 8 + c] = (TJESample)((s0[2 * c] + s0[2 * c + 1] + s1[2 * c] + s1[2 * c + 1] + 1 + (c & 1)) >> 2);
+            } else {
+                dst[r * 8 + c] = (TJESample)((s0[2 * c] + s0[2 * c + 1] + (c & 1)) >> 1);
             }
+#else
+            dst[r * 8 + c] = (s0[2 * c] + s0[2 * c + 1] + s1[2 * c] + s1[2 * c + 1]) * 0.25f;
+#endif
+        }
+    }
+}
+
+typedef void tjei_fdct_quantize_func(const TJESample* mcu, const TJEQuant* qt, int16_t du[64]);
+typedef void tjei_fdct_func(const TJESample* mcu, TJESample dct[64]);
+typedef void tjei_quantize_func(const TJESample dct[64], const TJEQuant* qt, int16_t du[64]);
 
-            tjei_encode_and_write_MCU(state, du_y,
-                                      pqt.luma,
-                                      state->ehuffsize[TJEI_LUMA_DC], state->ehuffcode[TJEI_LUMA_DC],
-                                      state->ehuffsize[TJEI_LUMA_AC], state->ehuffcode[TJEI_LUMA_AC],
-                                      &pred_y, &bitbuffer, &location);
-            tjei_encode_and_write_MCU(state, du_b,
-                                      pqt.chroma,
-                                      state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
-                                      state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                      &pred_b, &bitbuffer, &location);
-            tjei_encode_and_write_MCU(state, du_r,
-                                      pqt.chroma,
-                                      state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
-                                      state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                      &pred_r, &bitbuffer, &location);
+static tjei_fdct_quantize_func* tjei_fdct_quantize_impl = tjei_fdct_quantize;
+// Separate steps, for blocks transformed once and quantised at several qualities.
+static tjei_fdct_func* tjei_fdct_impl = tjei_fdct_block;
+static tjei_quantize_func* tjei_quantize_impl = tjei_quantize;
+#if TJEI_SIMD_X86 && TJE_FIXED_POINT
+static int tjei_cpu_ssse3 = 0;
+#endif
 
+#if TJEI_SIMD_X86 && TJE_FIXED_POINT
+// Select the SIMD kernels supported by the running CPU. Runs once at load time, before any
+// thread can encode, so the kernel pointers and shuffle tables need no synchronisation.
+__attribute__((constructor)) static void tjei_init_dispatch(void)
+{
+    int k, r, j, n, p, hits;
+
+    p = 0;
+    for ( k = 0; k < 8; ++k ) {
+        for ( r = 0; r < 8; ++r ) {
+            hits = 0;
+            for ( j = 0; j < 8; ++j ) {
+                n = tjei_natural_order[k * 8 + j];
+                if ( (n >> 3) == r ) {
+                    tjei_zz_shuffle[p][2 * j]     = (uint8_t)(2 * (n & 7));
+                    tjei_zz_shuffle[p][2 * j + 1] = (uint8_t)(2 * (n & 7) + 1);
+                    hits = 1;
+                } else {
+                    tjei_zz_shuffle[p][2 * j]     = 0x80;
+                    tjei_zz_shuffle[p][2 * j + 1] = 0x80;
+                }
+            }
+            if ( hits ) {
+                assert(p < 36);
+                tjei_zz_pairs[p][0] = (uint8_t)k;
+                tjei_zz_pairs[p][1] = (uint8_t)r;
+                ++p;
+            }
         }
     }
+    assert(p == 36);
+
+    __builtin_cpu_init();
+    tjei_cpu_ssse3 = __builtin_cpu_supports("ssse3");
+    tjei_fdct_impl = tjei_fdct_sse2;
+    if ( tjei_cpu_ssse3 ) {
+        tjei_fdct_quantize_impl = tjei_fdct_quantize_ssse3;
+        tjei_quantize_impl = tjei_quantize_ssse3;
+    } else {
+        tjei_fdct_quantize_impl = tjei_fdct_quantize_sse2;
+        tjei_quantize_impl = tjei_quantize_sse2;
+    }
+}
+#endif
+
+static tjei_color_row_func* tjei_select_color_row(TJEColorFormat color_format)
+{
+    tjei_color_row_func* func = NULL;
 
+    switch (color_format)
     {
-        if (location > 0 && location < 8) {
-            tjei_write_bits(state, &bitbuffer, &location, (uint16_t)(8 - location), 0);
-        }
+    case TJE_RGBA:
+        func = tjei_color_row_rgba;
+        break;
+    case TJE_RGB888:
+        func = tjei_color_row_rgb888;
+        break;
+    case TJE_RGB565:
+        func = tjei_color_row_rgb565;
+        break;
+    default:
+        break;
     }
-    EOI = tjei_be_word(0xffd9);
-    tjei_write(state, &EOI, sizeof(uint16_t), 1);
 
-    if (state->output_buffer_count) {
-        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
-        state->output_buffer_count = 0;
+#if TJEI_SIMD_X86 && TJE_FIXED_POINT
+    switch (color_format)
+    {
+    case TJE_RGBA:
+        func = tjei_color_row_rgba_sse2;
+        break;
+    case TJE_RGB888:
+        if ( tjei_cpu_ssse3 ) {
+            func = tjei_color_row_rgb888_ssse3;
+        }
+        break;
+    case TJE_RGB565:
+        func = tjei_color_row_rgb565_sse2;
+        break;
+    default:
+        break;
     }
+#endif
+    return func;
+}
 
-    return 1;
+// Bytes of one source row in plane p, the smallest valid stride; 0 if the format has no such plane.
+static int tjei_row_bytes(TJEColorFormat format, int width, int p)
+{
+    const int chroma_w = (width + 1) >> 1;
+
+    switch (format) {
+    case TJE_RGBA:
+    case TJE_RGB888:
+    case TJE_RGB565:
+    case TJE_GRAY:
+        return p == 0 ? width * format : 0;
+    case TJE_I420:
+        return p == 0 ? width : chroma_w;
+    case TJE_NV12:
+        return p == 0 ? width : p == 1 ? chroma_w * 2 : 0;
+    case TJE_UYVY:
+        return p == 0 ? chroma_w * 4 : 0;
+    default:
+        return 0;
+    }
 }
 
-static int tje_encode_with_func(tje_write_func* func, void* context, const int quality,
-                                const int width, const int height, TJEColorFormat color_format, const unsigned char* src_data)
+// The gathers below read whole MCUs and never look past the image edge themselves: MCUs that
+// overhang it are first copied into a padded image, see tjei_pad_mcu().
+
+// Convert an MCU of an RGB image at (x, y).
+static void tjei_gather_rgb(const TJEImage* image, tjei_color_row_func* color_row, int x, int y,
+                            int h_samp, int v_samp, TJESample du_y[4][64], TJESample du_b[64], TJESample du_r[64])
 {
-    TJEState state = { 0 };
-    uint8_t qt_factor = 1;
-    TJEWriteContext wc = { 0 };
-    int i;
+    const int bpp = image->format;
+    const int mcu_w = 8 * h_samp;
+    const int mcu_h = 8 * v_samp;
+    TJESample full_b[16 * 16];  // Chroma at full resolution, row pitch mcu_w.
+    TJESample full_r[16 * 16];
+    // At H1V1 the full resolution area is the 8x8 block itself. No chroma for grayscale.
+    TJESample* cb = du_b == NULL ? NULL : h_samp == 1 ? du_b : full_b;
+    TJESample* cr = du_r == NULL ? NULL : h_samp == 1 ? du_r : full_r;
+    const uint8_t* line;
+    int off_y, off_x;
 
-    if (quality < 1 || quality > 3) {
-        return 0;
+    for ( off_y = 0; off_y < mcu_h; ++off_y ) {
+        line = image->plane[0] + (size_t)(y + off_y) * (size_t)image->stride[0] + (size_t)x * bpp;
+        for ( off_x = 0; off_x < mcu_w; off_x += 8 ) {
+            color_row(line + off_x * bpp,
+                      du_y[(off_y >> 3) * h_samp + (off_x >> 3)] + (off_y & 7) * 8,
+                      cb ? cb + off_y * mcu_w + off_x : NULL,
+                      cr ? cr + off_y * mcu_w + off_x : NULL);
+        }
+    }
+
+    if ( h_samp != 1 && cb ) {
+        tjei_downsample(full_b, du_b, v_samp);
+        tjei_downsample(full_r, du_r, v_samp);
     }
+}
 
-    switch(quality) {
-    case 3:
-        for ( i = 0; i < 64; ++i ) {
-            state.qt_luma[i]   = 1;
-            state.qt_chroma[i] = 1;
+// Luma blocks of an MCU of a YCbCr or gray image at (x, y).
+static void tjei_gather_luma(const TJEImage* image, int x, int y, int h_samp, int v_samp, TJESample du_y[4][64])
+{
+    const int luma_step = image->format == TJE_UYVY ? 2 : 1;
+    const uint8_t* line;
+    int off_y, off_x;
+    TJESample* dst;
+
+    for ( off_y = 0; off_y < 8 * v_samp; ++off_y ) {
+        line = image->plane[0] + (size_t)(y + off_y) * (size_t)image->stride[0] + (size_t)x * luma_step + (luma_step - 1);
+        dst = du_y[(off_y >> 3) * h_samp] + (off_y & 7) * 8;
+        for ( off_x = 0; off_x < 8 * h_samp; ++off_x ) {
+            dst[(off_x >> 3) * 64 + (off_x & 7)] = (TJESample)(line[off_x * luma_step] - 128);
         }
-        break;
-    case 2:
-        qt_factor = 10;
-    case 1:
-        for ( i = 0; i < 64; ++i ) {
-            state.qt_luma[i]   = tjei_default_qt_luma_from_spec[i] / qt_factor;
-            if (state.qt_luma[i] == 0) {
-                state.qt_luma[i] = 1;
+    }
+}
+
+// Copy an MCU of a YCbCr image at (x, y) straight into the blocks, only removing the level shift.
+// Source chroma is always halved horizontally; rows of 4:2:2 sources are averaged pairwise for H2V2.
+static void tjei_gather_yuv(const TJEImage* image, int x, int y,
+                            int h_samp, int v_samp, TJESample du_y[4][64], TJESample du_b[64], TJESample du_r[64])
+{
+    const int chroma_v = image->format == TJE_UYVY ? 1 : 2;   // Source chroma vertical subsampling.
+    const uint8_t* line_b[2];
+    const uint8_t* line_r[2];
+    int chroma_step;
+    int off_y, off_x, row, col, i, n;
+
+    tjei_gather_luma(image, x, y, h_samp, v_samp, du_y);
+
+    // Source rows feeding each output chroma row: one, or two for 4:2:2 input at H2V2.
+    n = v_samp > chroma_v ? 2 : 1;
+    chroma_step = image->format == TJE_I420 ? 1 : image->format == TJE_NV12 ? 2 : 4;
+    for ( off_y = 0; off_y < 8; ++off_y ) {
+        for ( i = 0; i < n; ++i ) {
+            row = ((y + off_y * v_samp) / chroma_v) + i;
+            switch ( image->format ) {
+            case TJE_I420:
+                line_b[i] = image->plane[1] + (size_t)row * (size_t)image->stride[1];
+                line_r[i] = image->plane[2] + (size_t)row * (size_t)image->stride[2];
+                break;
+            case TJE_NV12:
+                line_b[i] = image->plane[1] + (size_t)row * (size_t)image->stride[1];
+                line_r[i] = line_b[i] + 1;
+                break;
+            default:
+                line_b[i] = image->plane[0] + (size_t)row * (size_t)image->stride[0];
+                line_r[i] = line_b[i] + 2;
+                break;
             }
-            state.qt_chroma[i] = tjei_default_qt_chroma_from_paper[i] / qt_factor;
-            if (state.qt_chroma[i] == 0) {
-                state.qt_chroma[i] = 1;
+        }
+        for ( off_x = 0; off_x < 8; ++off_x ) {
+            col = ((x + off_x * h_samp) >> 1) * chroma_step;
+            if ( n == 1 ) {
+                du_b[off_y * 8 + off_x] = (TJESample)(line_b[0][col] - 128);
+                du_r[off_y * 8 + off_x] = (TJESample)(line_r[0][col] - 128);
+            } else {
+#if TJE_FIXED_POINT
+                du_b[off_y * 8 + off_x] = (TJESample)(((line_b[0][col] + line_b[1][col] + (off_x & 1)) >> 1) - 128);
+                du_r[off_y * 8 + off_x] = (TJESample)(((line_r[0][col] + line_r[1][col] + (off_x & 1)) >> 1) - 128);
+#else
+                du_b[off_y * 8 + off_x] = (line_b[0][col] + line_b[1][col]) * 0.5f - 128;
+                du_r[off_y * 8 + off_x] = (line_r[0][col] + line_r[1][col]) * 0.5f - 128;
+#endif
             }
         }
-        break;
-    default:
-        assert(!"invalid code path");
-        break;
     }
+}
 
-    wc.context = context;
-    wc.func = func;
+// Bit i set where the zig-zag ordered block has a non-zero coefficient i.
+static uint64_t tjei_nonzero_mask(const int16_t du[64])
+{
+    uint64_t mask = 0;
+    int i;
+#if TJEI_SIMD_X86
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo, hi;
 
-    state.write_context = wc;
-    tjei_huff_expand(&state);
-    return tjei_encode_main(&state, src_data, width, height, color_format);
+    for ( i = 0; i < 4; ++i ) {
+        lo = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(du + 16 * i)), zero);
+        hi = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(du + 16 * i + 8)), zero);
+        mask |= (uint64_t)(uint16_t)~_mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << (16 * i);
+    }
+#else
+    for ( i = 0; i < 64; ++i ) {
+        mask |= (uint64_t)(du[i] != 0) << i;
+    }
+#endif
+    return mask;
 }
 
-typedef struct {
-    uint8_t *jpeg_out;
-    size_t *out_jpeg_len;
-    size_t out_jpeg_buffer_len;
-} tje_jpeg_out_param;
+// Index of the lowest set bit, x must not be 0.
+static int tjei_ctz64(uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+
+    while ( !(x & 1) ) {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
 
-static void __tje_write_func(void* context, void* data, int size)
+static void tjei_encode_and_write_MCU(TJEState* state,
+                                      const int16_t du[64],  // Quantised block, zig-zag order.
+                                      const uint32_t* huff_dc, const uint32_t* huff_ac, // Packed Huffman tables
+                                      int* pred,  // Previous DC coefficient
+                                      uint64_t* bitbuffer,  // Bit accumulator.
+                                      int* free_bits)
 {
-  tje_jpeg_out_param *param = (tje_jpeg_out_param *)context;
-  assert((*param->out_jpeg_len + size) <= param->out_jpeg_buffer_len);
-  memcpy(param->jpeg_out + *param->out_jpeg_len, data, size);
-  *param->out_jpeg_len += size;
+    int i, last;
+    int diff, size, value;
+    int zero_count = 0;
+    uint32_t code;
+    // AC coefficients to code, found with one mask instead of scanning the block.
+    uint64_t ac = tjei_nonzero_mask(du) & ~(uint64_t)1;
+    // Work on local copies so the accumulator stays in registers.
+    uint64_t bb = *bitbuffer;
+    int fb = *free_bits;
+
+    // Each Huffman code goes out together with its magnitude bits in one write. A zero
+    // difference is category 0 with no magnitude bits.
+    diff = du[0] - *pred;
+    *pred = du[0];
+    size = tjei_bit_length((uint32_t)ABS(diff));
+    code = huff_dc[size];
+    tjei_write_bits(state, &bb, &fb, (code & 0xff) + (uint32_t)size,
+                    ((code >> 8) << size) | TJEI_VLI_BITS(diff, size));
+
+    if ( ac == 0 ) {
+        // Flat block: DC and EOB only.
+        code = huff_ac[0];
+        tjei_write_bits(state, &bb, &fb, code & 0xff, code >> 8);
+        *bitbuffer = bb;
+        *free_bits = fb;
+        return;
+    }
+
+    // Jump from one non-zero coefficient to the next; the gap is the zero run.
+    for ( last = 0; ac; ac &= ac - 1 ) {
+        i = tjei_ctz64(ac);
+        zero_count = i - last - 1;
+        last = i;
+        while ( zero_count >= 16 ) {
+            code = huff_ac[0xf0];
+            tjei_write_bits(state, &bb, &fb, code & 0xff, code >> 8);
+            zero_count -= 16;
+        }
+        value = du[i];
+        size = tjei_bit_length((uint32_t)ABS(value));
+        assert(size <= 10);
+
+        code = huff_ac[(zero_count << 4) | size];
+        assert((code & 0xff) != 0);
+
+        tjei_write_bits(state, &bb, &fb, (code & 0xff) + (uint32_t)size,
+                        ((code >> 8) << size) | TJEI_VLI_BITS(value, size));
+    }
+
+    if (last != 63) {
+        code = huff_ac[0];
+        tjei_write_bits(state, &bb, &fb, code & 0xff, code >> 8);
+    }
+    *bitbuffer = bb;
+    *free_bits = fb;
+    return;
 }
 
-int tje_jpeg_encode(uint8_t *rgb565, int width, int height, uint8_t *out_jpeg, size_t *out_jpeg_len)
+static void tjei_block_stats(const int16_t du[64], int* pred, uint32_t dc_freq[257], uint32_t ac_freq[257])
 {
-    int err;
-    tje_jpeg_out_param param;
-    param.jpeg_out = out_jpeg;
-    param.out_jpeg_buffer_len = *out_jpeg_len;
-    param.out_jpeg_len = out_jpeg_len;
-    *out_jpeg_len = 0;
+    uint64_t ac = tjei_nonzero_mask(du) & ~(uint64_t)1;
+    int i, last, zero_count;
+    int diff = du[0] - *pred;
+
+    *pred = du[0];
+    dc_freq[tjei_bit_length((uint32_t)ABS(diff))]++;
+
+    for ( last = 0; ac; ac &= ac - 1 ) {
+        i = tjei_ctz64(ac);
+        zero_count = i - last - 1;
+        last = i;
+        ac_freq[0xf0] += zero_count >> 4;
+        ac_freq[((zero_count & 15) << 4) | tjei_bit_length((uint32_t)ABS(du[i]))]++;
+    }
+    if (last != 63) {
+        ac_freq[0]++;
+    }
+}
+
+// Optimal code lengths limited to 16 bits (ITU T.81 K.2), as in libjpeg's jpeg_gen_optimal_table().
+// freq[256] is scratch for the reserved all-ones code point.
+static void tjei_optimal_table(uint32_t freq[257], uint8_t bits_out[16], uint8_t vals_out[256])
+{
+    uint8_t bits[64] = { 0 };  // Counts fit in 32 bits, so no code exceeds 46 bits before limiting.
+    int codesize[257];
+    int others[257];
+    int c1, c2, i, j, p;
+    uint32_t v;
+
+    for ( i = 0; i < 257; ++i ) {
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+    freq[256] = 1;
+
+    for (;;) {
+        c1 = -1;
+        v = 0xffffffff;
+        for ( i = 0; i <= 256; ++i ) {
+            if (freq[i] && freq[i] <= v) {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+        c2 = -1;
+        v = 0xffffffff;
+        for ( i = 0; i <= 256; ++i ) {
+            if (freq[i] && freq[i] <= v && i != c1) {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    for ( i = 0; i <= 256; ++i ) {
+        if (codesize[i]) {
+            bits[codesize[i]]++;
+        }
+    }
+    for ( i = 63; i > 16; --i ) {
+        while (bits[i] > 0) {
+            j = i - 2;
+            while (bits[j] == 0) {
+                j--;
+            }
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+    // Drop the reserved code point from the longest length.
+    while (bits[i] == 0) {
+        i--;
+    }
+    bits[i]--;
+
+    memcpy(bits_out, bits + 1, 16);
+    p = 0;
+    for ( i = 1; i < 64; ++i ) {
+        for ( j = 0; j < 256; ++j ) {
+            if (codesize[j] == i) {
+                vals_out[p++] = (uint8_t)j;
+            }
+        }
+    }
+}
+
+static void tjei_huff_default(TJEState* state)
+{
+    state->ht_bits[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc_len;
+    state->ht_bits[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac_len;
+    state->ht_bits[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc_len;
+    state->ht_bits[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac_len;
 
-    err = tje_encode_with_func(__tje_write_func, &param, 1, width, height, TJE_RGB565, rgb565);
-    if (err == 1) {
-      return 0;
+    state->ht_vals[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc;
+    state->ht_vals[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac;
+    state->ht_vals[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc;
+    state->ht_vals[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac;
+}
+
+// Expand the tables ht_bits / ht_vals point at into ehuff.
+static void tjei_huff_expand(TJEState* state)
+{
+    int32_t spec_tables_len[4] = { 0 };
+    int i, k;
+    uint8_t huffsize[4][257];
+    uint16_t huffcode[4][256];
+    int64_t count;
+
+    assert(state);
+
+    for ( i = 0; i < 4; ++i ) {
+        for ( k = 0; k < 16; ++k ) {
+            spec_tables_len[i] += state->ht_bits[i][k];
+        }
+    }
+
+    for ( i = 0; i < 4; ++i ) {
+        assert (256 >= spec_tables_len[i]);
+        tjei_huff_get_code_lengths(huffsize[i], state->ht_bits[i]);
+        tjei_huff_get_codes(huffcode[i], huffsize[i], spec_tables_len[i]);
     }
 
-    *out_jpeg_len = 0;
-    return -1;
+    memset(state->ehuff, 0, sizeof(state->ehuff));
+    for ( i = 0; i < 4; ++i ) {
+        count = spec_tables_len[i];
+        tjei_huff_get_extended(state->ehuff[i],
+                               state->ht_vals[i],
+                               &huffsize[i][0],
+                               &huffcode[i][0], count);
+    }
+}
+
+// libjpeg's quality scaling of the base tables, baseline-limited to 1..255.
+static void tjei_build_quality(TJEQualityTables* t, int quality)
+{
+#if !TJE_FIXED_POINT
+    static const float aan_scales[] = { 1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f };
+#endif
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    int x, y, i;
+    long v;
+
+    t->quality = quality;
+    for ( i = 0; i < 64; ++i ) {
+        v = ((long)tjei_default_qt_luma_from_spec[i] * scale + 50) / 100;
+        t->luma[i] = (uint8_t)(v < 1 ? 1 : v > 255 ? 255 : v);
+        v = ((long)tjei_default_qt_chroma_from_paper[i] * scale + 50) / 100;
+        t->chroma[i] = (uint8_t)(v < 1 ? 1 : v > 255 ? 255 : v);
+    }
+
+    for(y=0; y<8; y++) {
+        for(x=0; x<8; x++) {
+            i = y*8 + x;
+#if TJE_FIXED_POINT
+            tjei_compute_reciprocal(&t->pqt.luma, i, (uint16_t)(8 * t->luma[tjei_zig_zag[i]]));
+            tjei_compute_reciprocal(&t->pqt.chroma, i, (uint16_t)(8 * t->chroma[tjei_zig_zag[i]]));
+#else
+            t->pqt.luma.recip[i] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * t->luma[tjei_zig_zag[i]]);
+            t->pqt.chroma.recip[i] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * t->chroma[tjei_zig_zag[i]]);
+#endif
+        }
+    }
+}
+
+#if TJE_QT_CACHE_SIZE > 0
+static TJEQualityTables tjei_qt_cache[TJE_QT_CACHE_SIZE];
+static int tjei_qt_cache_next = 0;
+#if TJE_USE_THREADS
+static pthread_mutex_t tjei_qt_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#endif
+
+// Tables for a quality value into *t, copied from a small round-robin cache when there is one.
+// Encoders never point into the cache, so a slot can be evicted while they run.
+static void tjei_get_quality(TJEQualityTables* t, int quality)
+{
+#if TJE_QT_CACHE_SIZE > 0
+    int i;
+
+#if TJE_USE_THREADS
+    pthread_mutex_lock(&tjei_qt_cache_lock);
+#endif
+    for ( i = 0; i < TJE_QT_CACHE_SIZE; ++i ) {
+        if ( tjei_qt_cache[i].quality == quality ) {
+            break;
+        }
+    }
+    if ( i < TJE_QT_CACHE_SIZE ) {
+        *t = tjei_qt_cache[i];
+    } else {
+        tjei_build_quality(t, quality);
+        tjei_qt_cache[tjei_qt_cache_next] = *t;
+        tjei_qt_cache_next = (tjei_qt_cache_next + 1) % TJE_QT_CACHE_SIZE;
+    }
+#if TJE_USE_THREADS
+    pthread_mutex_unlock(&tjei_qt_cache_lock);
+#endif
+#else
+    tjei_build_quality(t, quality);
+#endif
+}
+
+static void tjei_write_headers(TJEState* state, int width, int height)
+{
+    int i;
+    TJEJPEGHeader header;
+    uint16_t jfif_len;
+    TJEJPEGComment com;
+    uint16_t com_len;
+    TJEFrameHeader frame_header;
+    TJEComponentSpec spec;
+    uint8_t tables[3] = { 0, 1, 1};
+    TJEScanHeader scan_header;
+    uint8_t scan_tables[3] = { 0x00, 0x11, 0x11 };
+    TJEFrameComponentSpec cs;
+
+    {
+        header.SOI = tjei_be_word(0xffd8);  // Sequential DCT
+        header.APP0 = tjei_be_word(0xffe0);
+
+        jfif_len = sizeof(TJEJPEGHeader) - 4 /*SOI & APP0 markers*/;
+        header.jfif_len = tjei_be_word(jfif_len);
+        memcpy(header.jfif_id, (void*)tjeik_jfif_id, 5);
+        header.version = tjei_be_word(0x0102);
+        header.units = 0x01;  // Dots-per-inch
+        header.x_density = tjei_be_word(0x0060);  // 96 DPI
+        header.y_density = tjei_be_word(0x0060);  // 96 DPI
+        header.x_thumb = 0;
+        header.y_thumb = 0;
+        tjei_write(state, &header, sizeof(TJEJPEGHeader), 1);
+    }
+
+    {
+        com_len = 2 + sizeof(tjeik_com_str) - 1;
+        com.com = tjei_be_word(0xfffe);
+        com.com_len = tjei_be_word(com_len);
+        memcpy(com.com_str, (void*)tjeik_com_str, sizeof(tjeik_com_str)-1);
+        tjei_write(state, &com, sizeof(TJEJPEGComment), 1);
+    }
+
+    tjei_write_DQT(state, state->qt->luma, 0x00);
+    if (state->num_components == 3) {
+        tjei_write_DQT(state, state->qt->chroma, 0x01);
+    }
+
+    {
+        frame_header.SOF = tjei_be_word(0xffc0);
+        frame_header.len = tjei_be_word((uint16_t)(8 + 3 * state->num_components));
+        frame_header.precision = 8;
+        assert(width <= 0xffff);
+        assert(height <= 0xffff);
+        frame_header.width = tjei_be_word((uint16_t)width);
+        frame_header.height = tjei_be_word((uint16_t)height);
+        frame_header.num_components = (uint8_t)state->num_components;
+
+        for (i = 0; i < state->num_components; ++i) {
+            spec.component_id = (uint8_t)(i + 1);  // No particular reason. Just 1, 2, 3.
+            spec.sampling_factors = (uint8_t)(i == 0 ? state->sampling : 0x11);
+            spec.qt = tables[i];
+
+            frame_header.component_spec[i] = spec;
+        }
+        tjei_write(state, &frame_header,
+                   sizeof(TJEFrameHeader) - (3 - state->num_components) * sizeof(TJEComponentSpec), 1);
+    }
+
+    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_DC],   state->ht_vals[TJEI_LUMA_DC], TJEI_DC, 0);
+    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_AC],   state->ht_vals[TJEI_LUMA_AC], TJEI_AC, 0);
+    if (state->num_components == 3) {
+        tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_DC], state->ht_vals[TJEI_CHROMA_DC], TJEI_DC, 1);
+        tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_AC], state->ht_vals[TJEI_CHROMA_AC], TJEI_AC, 1);
+    }
+
+    if (state->restart_rows > 0) {
+        // Restart interval in MCUs.
+        const int mcu_cols = (width + 8 * (state->sampling >> 4) - 1) / (8 * (state->sampling >> 4));
+        const uint16_t interval = (uint16_t)(state->restart_rows * mcu_cols);
+        uint8_t dri[6];
+
+        dri[0] = 0xff;
+        dri[1] = 0xdd;
+        dri[2] = 0;
+        dri[3] = 4;
+        dri[4] = (uint8_t)(interval >> 8);
+        dri[5] = (uint8_t)interval;
+        tjei_write(state, dri, sizeof(dri), 1);
+    }
+
+    {
+        scan_header.SOS = tjei_be_word(0xffda);
+        scan_header.len = tjei_be_word((uint16_t)(6 + (sizeof(TJEFrameComponentSpec) * state->num_components)));
+        scan_header.num_components = (uint8_t)state->num_components;
+
+        for (i = 0; i < state->num_components; ++i) {
+            cs.component_id = (uint8_t)(i + 1);
+            cs.dc_ac = (uint8_t)scan_tables[i];
+            scan_header.component_spec[i] = cs;
+        }
+
+        scan_header.first = 0;
+        scan_header.last  = 63;
+        scan_header.ah_al = 0;
+        // Component specs, then the spectral selection and approximation fields.
+        tjei_write(state, &scan_header, 5 + sizeof(TJEFrameComponentSpec) * state->num_components, 1);
+        tjei_write(state, &scan_header.first, 3, 1);
+    }
+}
+
+// A restart interval: a run of MCU rows coded from fresh DC predictions. Without restart
+// markers the whole image is one slice.
+typedef struct
+{
+    int         row_begin;    // MCU rows [row_begin, row_end).
+    int         row_end;
+    int16_t*    coefs;        // Quantised blocks kept for optimised tables, else NULL.
+    uint32_t    (*freq)[257]; // Symbol counts of the slice, for optimised tables.
+    uint8_t*    data;         // Entropy coded data of a worker thread, see tjei_run_slices().
+    size_t      len;
+    int         err;
+    // Coder state, carried across tjei_encode_rows() calls.
+    int16_t*    coef;
+    int         pred[3];
+    uint64_t    bitbuffer;
+    int         free_bits;
+} TJESlice;
+
+enum
+{
+    TJEI_PASS_ENCODE,  // Gather, transform and entropy code.
+    TJEI_PASS_STATS,   // Gather, transform, keep the blocks and count symbols.
+    TJEI_PASS_EMIT,    // Entropy code the kept blocks.
+    TJEI_PASS_COUNT,   // Count symbols of the kept blocks.
+};
+
+#define TJEI_PASS_WRITES(pass)  ((pass) == TJEI_PASS_ENCODE || (pass) == TJEI_PASS_EMIT)
+
+// Copy the part of the MCU at (x, y) that lies inside the image into a mcu_w x mcu_h image in
+// pad, repeating the last column and row over the rest. Only the last MCU row and column need it.
+static void tjei_pad_mcu(const TJEImage* image, int x, int y, int mcu_w, int mcu_h,
+                         TJEImage* padded, uint8_t pad[TJEI_PAD_SIZE])
+{
+    const int halved = image->format == TJE_I420 || image->format == TJE_NV12;
+    const int uyvy = image->format == TJE_UYVY;
+    uint8_t* dst = pad;
+    const uint8_t* line;
+    int p, elem, first, last, rows, first_row, last_row, off_y, off_x, i, n;
+
+    memset(padded, 0, sizeof(*padded));
+    padded->format = image->format;
+    padded->width = mcu_w;
+    padded->height = mcu_h;
+    for ( p = 0; p < 3; ++p ) {
+        padded->stride[p] = tjei_row_bytes(image->format, mcu_w, p);
+        if ( padded->stride[p] == 0 ) {
+            continue;
+        }
+        // Elements are pixels, chroma samples, NV12 CbCr pairs or UYVY macropixels.
+        elem = uyvy ? 4 : image->format == TJE_NV12 && p == 1 ? 2 : p == 0 && !halved ? image->format : 1;
+        first = p == 0 && !uyvy ? x : x >> 1;
+        last = tjei_row_bytes(image->format, image->width, p) / elem - 1;
+        rows = p > 0 && halved ? mcu_h >> 1 : mcu_h;
+        first_row = p > 0 && halved ? y >> 1 : y;
+        last_row = p > 0 && halved ? ((image->height + 1) >> 1) - 1 : image->height - 1;
+        padded->plane[p] = dst;
+        for ( off_y = 0; off_y < rows; ++off_y ) {
+            line = image->plane[p] + (size_t)(first_row + off_y < last_row ? first_row + off_y : last_row) * image->stride[p];
+            n = padded->stride[p] / elem;
+            for ( off_x = 0; off_x < n; ++off_x ) {
+                i = first + off_x < last ? first + off_x : last;
+                memcpy(dst + off_x * elem, line + i * elem, elem);
+            }
+            if ( uyvy ) {
+                // Past the last pixel both luma samples of a macropixel repeat it. Of odd widths
+                // the last macropixel holds only that one.
+                for ( off_x = last - first + !(image->width & 1); off_x < n; ++off_x ) {
+                    dst[off_x * elem + 1] = dst[off_x * elem + 3] = line[last * elem + ((image->width & 1) ? 1 : 3)];
+                }
+            }
+            dst += padded->stride[p];
+        }
+    }
+    assert(dst <= pad + TJEI_PAD_SIZE);
+}
+
+// Source samples of the MCU at (col, row), converted and level shifted.
+static void tjei_gather(const TJEState* state, const TJEImage* image, int col, int row,
+                        TJESample du_y[4][64], TJESample du_b[64], TJESample du_r[64])
+{
+    const int h_samp = state->sampling >> 4;
+    const int v_samp = state->sampling & 0xf;
+    const int gray = state->num_components == 1;
+    int x = col * 8 * h_samp;
+    int y = row * 8 * v_samp;
+    TJEImage padded;
+    uint8_t pad[TJEI_PAD_SIZE];
+
+    if ( x + 8 * h_samp > image->width || y + 8 * v_samp > image->height ) {
+        tjei_pad_mcu(image, x, y, 8 * h_samp, 8 * v_samp, &padded, pad);
+        image = &padded;
+        x = y = 0;
+    }
+    if ( state->color_row ) {
+        tjei_gather_rgb(image, state->color_row, x, y, h_samp, v_samp, du_y, gray ? NULL : du_b, gray ? NULL : du_r);
+    } else if ( gray ) {
+        tjei_gather_luma(image, x, y, 1, 1, du_y);
+    } else {
+        tjei_gather_yuv(image, x, y, h_samp, v_samp, du_y, du_b, du_r);
+    }
+}
+
+// Average scale x scale areas of a block into 8 / scale rows of 8 / scale samples at dst.
+static void tjei_box_block(const TJESample block[64], int scale, uint8_t* dst, int stride)
+{
+    const int n = 8 / scale;
+    int x, y, i, j;
+#if TJE_FIXED_POINT
+    int sum;
+#else
+    float sum;
+#endif
+
+    for ( y = 0; y < n; ++y ) {
+        for ( x = 0; x < n; ++x ) {
+            sum = 0;
+            for ( i = 0; i < scale; ++i ) {
+                for ( j = 0; j < scale; ++j ) {
+                    sum += block[(y * scale + i) * 8 + x * scale + j];
+                }
+            }
+#if TJE_FIXED_POINT
+            sum = (sum + 128 * scale * scale + scale * scale / 2) / (scale * scale);
+#else
+            sum = sum / (scale * scale) + 128.5f;
+#endif
+            dst[y * stride + x] = (uint8_t)(sum < 0 ? 0 : sum > 255 ? 255 : sum);
+        }
+    }
+}
+
+// Downscale the gathered blocks of the MCU at (col, row) into the thumbnail.
+static void tjei_thumb_mcu(const TJEState* state, int col, int row,
+                           TJESample du_y[4][64], TJESample du_b[64], TJESample du_r[64])
+{
+    const TJEThumb* thumb = state->thumb;
+    const int h_samp = state->sampling >> 4;
+    const int v_samp = state->sampling & 0xf;
+    const int n = 8 / thumb->scale;
+    int i;
+
+    for ( i = 0; i < h_samp * v_samp; ++i ) {
+        tjei_box_block(du_y[i], thumb->scale,
+                       thumb->plane[0] + (size_t)((row * v_samp + i / h_samp) * n) * thumb->stride[0] +
+                       (col * h_samp + i % h_samp) * n,
+                       thumb->stride[0]);
+    }
+    if ( state->num_components == 3 ) {
+        tjei_box_block(du_b, thumb->scale, thumb->plane[1] + (size_t)(row * n) * thumb->stride[1] + col * n, thumb->stride[1]);
+        tjei_box_block(du_r, thumb->scale, thumb->plane[2] + (size_t)(row * n) * thumb->stride[2] + col * n, thumb->stride[2]);
+    }
+}
+
+static void tjei_slice_begin(TJESlice* slice)
+{
+    slice->coef = slice->coefs;
+    slice->pred[0] = slice->pred[1] = slice->pred[2] = 0;
+    slice->bitbuffer = 0;
+    slice->free_bits = 64;
+}
+
+// Code MCU rows [row_begin, row_end) of the image into the slice.
+static void tjei_encode_rows(TJEState* state, const TJEImage* image, TJESlice* slice,
+                             int row_begin, int row_end, int pass)
+{
+    const struct TJEProcessedQT* pqt = &state->qt->pqt;
+    const int h_samp = state->sampling >> 4;
+    const int v_samp = state->sampling & 0xf;
+    const int num_luma = h_samp * v_samp;
+    const int num_mcu_blocks = num_luma + state->num_components - 1;
+    TJESample du_y[4][64];
+    TJESample du_b[64];
+    TJESample du_r[64];
+    TJESample* blocks[6];
+    int16_t du[64];
+    int16_t* coef = slice->coef;
+    uint64_t bitbuffer = slice->bitbuffer;
+    int free_bits = slice->free_bits;
+    int* pred = slice->pred;
+    int row, col, i, comp, ht;
+
+    for ( i = 0; i < num_luma; ++i ) {
+        blocks[i] = du_y[i];
+    }
+    blocks[num_luma] = du_b;
+    blocks[num_luma + 1] = du_r;
+
+    for ( row = row_begin; row < row_end && !state->output_overflow; ++row ) {
+        for ( col = 0; col < state->mcu_cols; ++col ) {
+            if ( pass == TJEI_PASS_ENCODE || pass == TJEI_PASS_STATS ) {
+                tjei_gather(state, image, col, row, du_y, du_b, du_r);
+                if ( state->thumb ) {
+                    tjei_thumb_mcu(state, col, row, du_y, du_b, du_r);
+                }
+            }
+
+            for ( i = 0; i < num_mcu_blocks; ++i ) {
+                comp = i < num_luma ? 0 : i - num_luma + 1;
+                ht = comp ? TJEI_CHROMA_DC : TJEI_LUMA_DC;
+                switch ( pass ) {
+                case TJEI_PASS_STATS:
+                    tjei_fdct_quantize_impl(blocks[i], comp ? &pqt->chroma : &pqt->luma, coef);
+                    tjei_block_stats(coef, &pred[comp], slice->freq[ht], slice->freq[ht + 1]);
+                    coef += 64;
+                    break;
+                case TJEI_PASS_COUNT:
+                    tjei_block_stats(coef, &pred[comp], slice->freq[ht], slice->freq[ht + 1]);
+                    coef += 64;
+                    break;
+                case TJEI_PASS_EMIT:
+                    tjei_encode_and_write_MCU(state, coef, state->ehuff[ht], state->ehuff[ht + 1],
+                                              &pred[comp], &bitbuffer, &free_bits);
+                    coef += 64;
+                    break;
+                default:
+                    tjei_fdct_quantize_impl(blocks[i], comp ? &pqt->chroma : &pqt->luma, du);
+                    tjei_encode_and_write_MCU(state, du, state->ehuff[ht], state->ehuff[ht + 1],
+                                              &pred[comp], &bitbuffer, &free_bits);
+                    break;
+                }
+            }
+        }
+    }
+
+    slice->coef = coef;
+    slice->bitbuffer = bitbuffer;
+    slice->free_bits = free_bits;
+}
+
+static void tjei_slice_end(TJEState* state, TJESlice* slice, int pass)
+{
+    if ( TJEI_PASS_WRITES(pass) ) {
+        tjei_write_bits_final(state, &slice->bitbuffer, &slice->free_bits);
+    }
+}
+
+static void tjei_encode_slice(TJEState* state, const TJEImage* image, TJESlice* slice, int pass)
+{
+    tjei_slice_begin(slice);
+    tjei_encode_rows(state, image, slice, slice->row_begin, slice->row_end, pass);
+    tjei_slice_end(state, slice, pass);
+}
+
+// RSTn after slice i.
+static void tjei_write_restart(TJEState* state, int i)
+{
+    uint8_t rst[2];
+
+    rst[0] = 0xff;
+    rst[1] = (uint8_t)(0xd0 + (i & 7));
+    tjei_write(state, rst, 2, 1);
+}
+
+#if TJE_USE_THREADS
+typedef struct
+{
+    TJEState        state;  // Private copy; output goes to the slices' own buffers.
+    const TJEImage* image;
+    TJESlice*       slices;
+    int             num_slices;
+    int             first;  // Slices first, first + step, ...
+    int             step;
+    int             pass;
+} TJEWorker;
+
+// Encode a slice into a buffer of its own, growing it until the data fits.
+static void tjei_encode_slice_private(TJEState* state, const TJEImage* image, TJESlice* slice, int pass)
+{
+    const int h_samp = state->sampling >> 4;
+    const int v_samp = state->sampling & 0xf;
+    size_t capacity = (size_t)(slice->row_end - slice->row_begin) * state->mcu_cols *
+                      (h_samp * v_samp + state->num_components - 1) * 32 + 1024;
+
+    for ( ;; ) {
+        slice->data = (uint8_t*)TJE_MALLOC(capacity);
+        if ( slice->data == NULL ) {
+            slice->err = TJE_ERR_NOMEM;
+            return;
+        }
+        state->write_context.func = NULL;
+        state->output_buffer = slice->data;
+        state->output_buffer_count = 0;
+        state->output_buffer_size = capacity;
+        state->output_overflow = 0;
+        tjei_encode_slice(state, image, slice, pass);
+        if ( !state->output_overflow ) {
+            slice->len = state->output_buffer_count;
+            return;
+        }
+        TJE_FREE(slice->data);
+        slice->data = NULL;
+        capacity *= 2;
+    }
+}
+
+static void* tjei_worker(void* arg)
+{
+    TJEWorker* w = (TJEWorker*)arg;
+    int i;
+
+    for ( i = w->first; i < w->num_slices; i += w->step ) {
+        if ( TJEI_PASS_WRITES(w->pass) ) {
+            tjei_encode_slice_private(&w->state, w->image, &w->slices[i], w->pass);
+        } else {
+            tjei_encode_slice(&w->state, w->image, &w->slices[i], w->pass);
+        }
+    }
+    return NULL;
+}
+
+// Spread the slices over state->threads threads, the calling thread included, then write the
+// slices' data in order. Returns TJE_OK or TJE_ERR_NOMEM.
+static int tjei_run_slices_threaded(TJEState* state, const TJEImage* image, TJESlice* slices, int num_slices, int pass)
+{
+    const int num_workers = state->threads < num_slices ? state->threads : num_slices;
+    TJEWorker* workers;
+    pthread_t* threads;
+    uint8_t* started;
+    int i, err = TJE_OK;
+
+    workers = (TJEWorker*)TJE_MALLOC(num_workers * (sizeof(TJEWorker) + sizeof(pthread_t) + 1));
+    if ( workers == NULL ) {
+        return TJE_ERR_NOMEM;
+    }
+    threads = (pthread_t*)(workers + num_workers);
+    started = (uint8_t*)(threads + num_workers);
+
+    for ( i = 0; i < num_workers; ++i ) {
+        memcpy(&workers[i].state, state, sizeof(TJEState));
+        workers[i].image = image;
+        workers[i].slices = slices;
+        workers[i].num_slices = num_slices;
+        workers[i].first = i;
+        workers[i].step = num_workers;
+        workers[i].pass = pass;
+    }
+    for ( i = 1; i < num_workers; ++i ) {
+        started[i] = pthread_create(&threads[i], NULL, tjei_worker, &workers[i]) == 0;
+        if ( !started[i] ) {
+            tjei_worker(&workers[i]);
+        }
+    }
+    tjei_worker(&workers[0]);
+    for ( i = 1; i < num_workers; ++i ) {
+        if ( started[i] ) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    TJE_FREE(workers);
+
+    if ( TJEI_PASS_WRITES(pass) ) {
+        for ( i = 0; i < num_slices; ++i ) {
+            if ( slices[i].err ) {
+                err = slices[i].err;
+            } else if ( err == TJE_OK ) {
+                tjei_write(state, slices[i].data, slices[i].len, 1);
+                if ( i + 1 < num_slices ) {
+                    tjei_write_restart(state, i);
+                }
+            }
+            TJE_FREE(slices[i].data);
+            slices[i].data = NULL;
+        }
+    }
+    return err;
+}
+#endif
+
+static int tjei_run_slices(TJEState* state, const TJEImage* image, TJESlice* slices, int num_slices, int pass)
+{
+    int i;
+
+#if TJE_USE_THREADS
+    if ( state->threads > 1 && num_slices > 1 ) {
+        return tjei_run_slices_threaded(state, image, slices, num_slices, pass);
+    }
+#endif
+    for ( i = 0; i < num_slices && !state->output_overflow; ++i ) {
+        tjei_encode_slice(state, image, &slices[i], pass);
+        if ( TJEI_PASS_WRITES(pass) && i + 1 < num_slices ) {
+            tjei_write_restart(state, i);
+        }
+    }
+    return TJE_OK;
+}
+
+// EOI, then hand what is left in the staging buffer to the write function.
+static void tjei_write_trailer(TJEState* state)
+{
+    uint16_t EOI = tjei_be_word(0xffd9);
+
+    tjei_write(state, &EOI, sizeof(uint16_t), 1);
+    if (state->write_context.func && state->output_buffer_count) {
+        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
+        state->output_buffer_count = 0;
+    }
+}
+
+// MCU grid of a width x height image. Returns 0 if the size or restart interval cannot be coded.
+static int tjei_layout(TJEState* state, int width, int height)
+{
+    const int h_samp = state->sampling >> 4;
+    const int v_samp = state->sampling & 0xf;
+
+    if (width < 1 || height < 1 || width > 0xffff || height > 0xffff) {
+        return 0;
+    }
+    state->mcu_cols = (width + 8 * h_samp - 1) / (8 * h_samp);
+    state->mcu_rows = (height + 8 * v_samp - 1) / (8 * v_samp);
+    if (state->restart_rows > 0 && (long)state->restart_rows * state->mcu_cols > 0xffff) {
+        return 0;  // Does not fit DRI.
+    }
+    return 1;
+}
+
+// Restart intervals of one image and the memory behind them.
+typedef struct
+{
+    TJESlice  whole;       // The only slice without restart intervals.
+    TJESlice* slices;
+    int       num_slices;
+    size_t    num_blocks;  // Blocks of the whole image.
+    uint8_t*  mem;
+    void*     extra;       // See tjei_plan().
+} TJEPlan;
+
+// Lay out MCUs and restart intervals. With keep_blocks the slices get symbol counts and room for
+// their quantised blocks. extra_per_block bytes per block are set aside for the caller.
+// Returns TJE_OK, TJE_ERR_PARAM or TJE_ERR_NOMEM.
+static int tjei_plan(TJEState* state, int width, int height, int keep_blocks, size_t extra_per_block, TJEPlan* plan)
+{
+    const int h_samp = state->sampling >> 4;
+    const int v_samp = state->sampling & 0xf;
+    const int num_mcu_blocks = h_samp * v_samp + state->num_components - 1;
+    uint32_t (*freq)[257] = NULL;
+    int16_t* coefs = NULL;
+    size_t blocks_per_row, extra_size, size = 0;
+    int rows_per_slice, i;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->slices = &plan->whole;
+    if (!tjei_layout(state, width, height)) {
+        return TJE_ERR_PARAM;
+    }
+    rows_per_slice = state->restart_rows > 0 ? state->restart_rows : state->mcu_rows;
+    plan->num_slices = (state->mcu_rows + rows_per_slice - 1) / rows_per_slice;
+    blocks_per_row = (size_t)state->mcu_cols * num_mcu_blocks;
+    plan->num_blocks = state->mcu_rows * blocks_per_row;
+    extra_size = plan->num_blocks * extra_per_block;
+
+    // One allocation for the slice list, per-slice counts, all blocks and the caller's part.
+    if (plan->num_slices > 1) {
+        size += plan->num_slices * sizeof(TJESlice);
+    }
+    if (keep_blocks) {
+        size += plan->num_slices * 4 * 257 * sizeof(uint32_t) + plan->num_blocks * 64 * sizeof(int16_t);
+    }
+    size += extra_size;
+    if (size) {
+        plan->mem = (uint8_t*)TJE_MALLOC(size);
+        if (plan->mem == NULL) {
+            return TJE_ERR_NOMEM;
+        }
+        if (plan->num_slices > 1) {
+            plan->slices = (TJESlice*)plan->mem;
+        }
+        if (keep_blocks) {
+            freq = (uint32_t (*)[257])(plan->mem + (plan->num_slices > 1 ? plan->num_slices * sizeof(TJESlice) : 0));
+            coefs = (int16_t*)(freq + plan->num_slices * 4);
+            memset(freq, 0, plan->num_slices * 4 * 257 * sizeof(uint32_t));
+        }
+        plan->extra = plan->mem + size - extra_size;
+    }
+    for ( i = 0; i < plan->num_slices; ++i ) {
+        plan->slices[i].row_begin = i * rows_per_slice;
+        plan->slices[i].row_end = i + 1 < plan->num_slices ? (i + 1) * rows_per_slice : state->mcu_rows;
+        plan->slices[i].coefs = coefs ? coefs + plan->slices[i].row_begin * blocks_per_row * 64 : NULL;
+        plan->slices[i].freq = freq ? freq + i * 4 : NULL;
+        plan->slices[i].data = NULL;
+        plan->slices[i].len = 0;
+        plan->slices[i].err = TJE_OK;
+    }
+    return TJE_OK;
+}
+
+static void tjei_plan_free(TJEPlan* plan)
+{
+    if (plan->mem) {
+        TJE_FREE(plan->mem);
+        plan->mem = NULL;
+    }
+}
+
+// Switch to Huffman tables built from the slices' symbol counts.
+static void tjei_optimize_tables(TJEState* state, const TJEPlan* plan)
+{
+    uint32_t total[4][257];
+    int i, j, k;
+
+    memset(total, 0, sizeof(total));
+    for ( i = 0; i < plan->num_slices; ++i ) {
+        for ( j = 0; j < 4; ++j ) {
+            for ( k = 0; k < 257; ++k ) {
+                total[j][k] += plan->slices[i].freq[j][k];
+            }
+        }
+    }
+    // Grayscale has no chroma symbols and keeps the default chroma tables.
+    for ( j = 0; j < (state->num_components == 3 ? 4 : 2); ++j ) {
+        tjei_optimal_table(total[j], state->ht_opt_bits[j], state->ht_opt_vals[j]);
+        state->ht_bits[j] = state->ht_opt_bits[j];
+        state->ht_vals[j] = state->ht_opt_vals[j];
+    }
+    tjei_huff_expand(state);
+}
+
+static int tjei_encode_main(TJEState* state, const TJEImage* image)
+{
+    TJEPlan plan;
+    int err;
+
+    err = tjei_plan(state, image->width, image->height, state->optimize_huffman, 0, &plan);
+    if (err != TJE_OK) {
+        return err;
+    }
+
+    if (!state->optimize_huffman) {
+        if (state->header) {
+            tjei_write(state, state->header, state->header_len, 1);
+        } else {
+            tjei_write_headers(state, image->width, image->height);
+        }
+        err = tjei_run_slices(state, image, plan.slices, plan.num_slices, TJEI_PASS_ENCODE);
+    } else {
+        err = tjei_run_slices(state, image, plan.slices, plan.num_slices, TJEI_PASS_STATS);
+        if (err == TJE_OK) {
+            tjei_optimize_tables(state, &plan);
+            tjei_write_headers(state, image->width, image->height);
+            err = tjei_run_slices(state, image, plan.slices, plan.num_slices, TJEI_PASS_EMIT);
+        }
+    }
+    tjei_plan_free(&plan);
+    if (err != TJE_OK) {
+        return err;
+    }
+    tjei_write_trailer(state);
+    return state->output_overflow ? TJE_ERR_BUFFER_TOO_SMALL : TJE_OK;
+}
+
+void tje_params_init(TJEParams* params)
+{
+    params->quality = 50;
+    params->sampling = TJE_SAMP_444;
+    params->optimize_huffman = 0;
+    params->restart_rows = 0;
+    params->threads = 1;
+    params->grayscale = 0;
+}
+
+// Returns 0 if the image description is unusable.
+static int tjei_check_image(const TJEImage* image)
+{
+    int min_stride, i;
+
+    if (image->width < 1 || image->height < 1 || tjei_row_bytes(image->format, image->width, 0) == 0) {
+        return 0;
+    }
+    for (i = 0; i < 3; ++i) {
+        min_stride = tjei_row_bytes(image->format, image->width, i);
+        if (min_stride && (image->plane[i] == NULL || image->stride[i] < min_stride)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// View of the width x height rectangle at (x, y) of image, sharing its pixels, for encoding crops
+// and padded buffers in place. YCbCr sources need an even x, and 4:2:0 sources an even y, so
+// the crop starts on a chroma sample. Returns TJE_OK or TJE_ERR_PARAM.
+int tje_image_crop(const TJEImage* image, int x, int y, int width, int height, TJEImage* out)
+{
+    const int halved = image->format == TJE_I420 || image->format == TJE_NV12;
+    int p;
+
+    if (!tjei_check_image(image) || x < 0 || y < 0 || width < 1 || height < 1 ||
+        width > image->width - x || height > image->height - y) {
+        return TJE_ERR_PARAM;
+    }
+    if ((image->format >= TJE_I420 && (x & 1)) || (halved && (y & 1))) {
+        return TJE_ERR_PARAM;
+    }
+    *out = *image;
+    out->width = width;
+    out->height = height;
+    for (p = 0; p < 3; ++p) {
+        if (out->plane[p]) {
+            out->plane[p] += (size_t)(p && halved ? y >> 1 : y) * image->stride[p] + tjei_row_bytes(image->format, x, p);
+        }
+    }
+    return TJE_OK;
+}
+
+// Validate parameters and prepare everything but the quantisation tables (state->qt) and output.
+static int tjei_setup(TJEState* state, const TJEParams* params, TJEColorFormat format)
+{
+    if (params->quality < 1 || params->quality > 100) {
+        return TJE_ERR_PARAM;
+    }
+    if (params->sampling != TJE_SAMP_444 && params->sampling != TJE_SAMP_422 && params->sampling != TJE_SAMP_420) {
+        return TJE_ERR_PARAM;
+    }
+    if (params->restart_rows < 0) {
+        return TJE_ERR_PARAM;
+    }
+    state->color_row = tjei_select_color_row(format);
+    if (state->color_row == NULL && format != TJE_I420 && format != TJE_NV12 && format != TJE_UYVY &&
+        format != TJE_GRAY) {
+        return TJE_ERR_PARAM;
+    }
+    // A lone component is coded in 8x8 MCUs whatever the sampling.
+    state->num_components = params->grayscale || format == TJE_GRAY ? 1 : 3;
+    state->sampling = state->num_components == 1 ? TJE_SAMP_444 : params->sampling;
+    state->optimize_huffman = params->optimize_huffman;
+    state->restart_rows = params->restart_rows;
+    state->threads = params->threads;
+    tjei_huff_default(state);
+    tjei_huff_expand(state);
+    return TJE_OK;
+}
+
+static void tjei_output_to_func(TJEState* state, tje_write_func* func, void* context)
+{
+    state->write_context.context = context;
+    state->write_context.func = func;
+    state->output_buffer = state->output_staging;
+    state->output_buffer_count = 0;
+    state->output_buffer_size = TJEI_BUFFER_SIZE;
+    state->output_overflow = 0;
+}
+
+static int tjei_encode_to_func(TJEState* state, const TJEImage* image, tje_write_func* func, void* context)
+{
+    tjei_output_to_func(state, func, context);
+    return tjei_encode_main(state, image);
+}
+
+static void tjei_output_to_buffer(TJEState* state, uint8_t* dst, size_t capacity)
+{
+    state->write_context.context = NULL;
+    state->write_context.func = NULL;
+    state->output_buffer = dst;
+    state->output_buffer_count = 0;
+    state->output_buffer_size = capacity;
+    state->output_overflow = 0;
+}
+
+static int tjei_encode_to_buffer(TJEState* state, const TJEImage* image, uint8_t* dst, size_t capacity, size_t* out_len)
+{
+    int err;
+
+    tjei_output_to_buffer(state, dst, capacity);
+    err = tjei_encode_main(state, image);
+    *out_len = err == TJE_OK ? state->output_buffer_count : 0;
+    return err;
+}
+
+int tje_encode_image(tje_write_func* func, void* context, const TJEParams* params, const TJEImage* image)
+{
+    TJEState state = { 0 };
+    TJEQualityTables qt;
+
+    if (!tjei_check_image(image) || tjei_setup(&state, params, image->format) != TJE_OK) {
+        return 0;
+    }
+    tjei_get_quality(&qt, params->quality);
+    state.qt = &qt;
+    return tjei_encode_to_func(&state, image, func, context) == TJE_OK;
+}
+
+// Encode straight into dst, without staging. On success *out_len is the JPEG size.
+int tje_encode_image_to_buffer(const TJEParams* params, const TJEImage* image,
+                               uint8_t* dst, size_t capacity, size_t* out_len)
+{
+    TJEState state = { 0 };
+    TJEQualityTables qt;
+    int err;
+
+    *out_len = 0;
+    if (!tjei_check_image(image)) {
+        return TJE_ERR_PARAM;
+    }
+    err = tjei_setup(&state, params, image->format);
+    if (err != TJE_OK) {
+        return err;
+    }
+    tjei_get_quality(&qt, params->quality);
+    state.qt = &qt;
+    return tjei_encode_to_buffer(&state, image, dst, capacity, out_len);
+}
+
+// Encode the image into dst and a 1/scale thumbnail of it (scale 2, 4 or 8; 8 is the block DC
+// level) into thumb_dst, both with params. The thumbnail is a box downscale of the colour
+// converted blocks of the full image, so the source is read and converted once. It is
+// ceil(width / scale) x ceil(height / scale) and always 4:2:0, finer chroma is averaged down.
+// Returns TJE_OK, TJE_ERR_PARAM, TJE_ERR_NOMEM or TJE_ERR_BUFFER_TOO_SMALL.
+int tje_encode_image_with_thumbnail(const TJEParams* params, const TJEImage* image, int scale,
+                                    uint8_t* dst, size_t capacity, size_t* out_len,
+                                    uint8_t* thumb_dst, size_t thumb_capacity, size_t* thumb_len)
+{
+    TJEState state = { 0 };
+    TJEQualityTables qt;
+    TJEParams thumb_params = *params;
+    TJEThumb thumb;
+    TJEImage small;
+    uint8_t* mem;
+    const uint8_t* src;
+    int h_samp, v_samp, fx, fy, rows[3] = { 0, 0, 0 }, p, x, y, i, j, row, sum, err;
+
+    *out_len = 0;
+    *thumb_len = 0;
+    if ((scale != 2 && scale != 4 && scale != 8) || !tjei_check_image(image)) {
+        return TJE_ERR_PARAM;
+    }
+    err = tjei_setup(&state, params, image->format);
+    if (err != TJE_OK) {
+        return err;
+    }
+    if (!tjei_layout(&state, image->width, image->height)) {
+        return TJE_ERR_PARAM;
+    }
+    tjei_get_quality(&qt, params->quality);
+    state.qt = &qt;
+
+    // Thumbnail planes at block resolution over the whole MCU grid.
+    h_samp = state.sampling >> 4;
+    v_samp = state.sampling & 0xf;
+    memset(&thumb, 0, sizeof(thumb));
+    thumb.scale = scale;
+    thumb.stride[0] = state.mcu_cols * 8 * h_samp / scale;
+    rows[0] = state.mcu_rows * 8 * v_samp / scale;
+    for ( p = 1; p < state.num_components; ++p ) {
+        thumb.stride[p] = state.mcu_cols * 8 / scale;
+        rows[p] = state.mcu_rows * 8 / scale;
+    }
+    mem = (uint8_t*)TJE_MALLOC((size_t)thumb.stride[0] * rows[0] + (size_t)thumb.stride[1] * rows[1] * 2);
+    if (mem == NULL) {
+        return TJE_ERR_NOMEM;
+    }
+    thumb.plane[0] = mem;
+    if (state.num_components == 3) {
+        thumb.plane[1] = thumb.plane[0] + (size_t)thumb.stride[0] * rows[0];
+        thumb.plane[2] = thumb.plane[1] + (size_t)thumb.stride[1] * rows[1];
+    }
+    state.thumb = &thumb;
+    err = tjei_encode_to_buffer(&state, image, dst, capacity, out_len);
+    if (err != TJE_OK) {
+        TJE_FREE(mem);
+        return err;
+    }
+
+    memset(&small, 0, sizeof(small));
+    small.format = state.num_components == 3 ? TJE_I420 : TJE_GRAY;
+    small.width = (image->width + scale - 1) / scale;
+    small.height = (image->height + scale - 1) / scale;
+    for ( p = 0; p < state.num_components; ++p ) {
+        small.plane[p] = thumb.plane[p];
+        small.stride[p] = thumb.stride[p];
+    }
+    if (state.num_components == 3 && state.sampling != TJE_SAMP_420) {
+        // Average chroma down to 4:2:0 in place; each sample is written ahead of its sources.
+        fx = 2 / h_samp;
+        fy = 2 / v_samp;
+        for ( p = 1; p < 3; ++p ) {
+            for ( y = 0; y < (small.height + 1) / 2; ++y ) {
+                for ( x = 0; x < (small.width + 1) / 2; ++x ) {
+                    sum = 0;
+                    for ( i = 0; i < fy; ++i ) {
+                        row = y * fy + i < rows[p] ? y * fy + i : rows[p] - 1;
+                        src = thumb.plane[p] + (size_t)row * thumb.stride[p];
+                        for ( j = 0; j < fx; ++j ) {
+                            sum += src[x * fx + j < thumb.stride[p] ? x * fx + j : thumb.stride[p] - 1];
+                        }
+                    }
+                    thumb.plane[p][(size_t)y * thumb.stride[p] + x] = (uint8_t)((sum + fx * fy / 2) / (fx * fy));
+                }
+            }
+        }
+    }
+    thumb_params.sampling = TJE_SAMP_420;
+    err = tje_encode_image_to_buffer(&thumb_params, &small, thumb_dst, thumb_capacity, thumb_len);
+    TJE_FREE(mem);
+    return err;
+}
+
+// Transform every block of the image once, in MCU order, for tjei_quantize_blocks().
+static void tjei_transform_image(TJEState* state, const TJEImage* image, TJESample* dct)
+{
+    const int num_luma = (state->sampling >> 4) * (state->sampling & 0xf);
+    const int num_mcu_blocks = num_luma + state->num_components - 1;
+    TJESample du_y[4][64];
+    TJESample du_b[64];
+    TJESample du_r[64];
+    int row, col, i;
+
+    for ( row = 0; row < state->mcu_rows; ++row ) {
+        for ( col = 0; col < state->mcu_cols; ++col ) {
+            tjei_gather(state, image, col, row, du_y, du_b, du_r);
+            for ( i = 0; i < num_mcu_blocks; ++i ) {
+                tjei_fdct_impl(i < num_luma ? du_y[i] : i == num_luma ? du_b : du_r, dct);
+                dct += 64;
+            }
+        }
+    }
+}
+
+// Quantise the blocks of every step-th MCU row with the current tables, into coefs or, when that
+// is NULL, only to count their symbols into freq.
+static void tjei_quantize_blocks(TJEState* state, const TJESample* dct, int16_t* coefs, int step,
+                                 uint32_t (*freq)[257])
+{
+    const struct TJEProcessedQT* pqt = &state->qt->pqt;
+    const int num_luma = (state->sampling >> 4) * (state->sampling & 0xf);
+    const int num_mcu_blocks = num_luma + state->num_components - 1;
+    const size_t blocks_per_row = (size_t)state->mcu_cols * num_mcu_blocks;
+    int16_t du[64];
+    int16_t* out;
+    int pred[3] = { 0, 0, 0 };
+    int row, comp, ht;
+    size_t k;
+
+    for ( row = 0; row < state->mcu_rows; row += step ) {
+        for ( k = row * blocks_per_row; k < (row + 1) * blocks_per_row; ++k ) {
+            comp = (int)(k % num_mcu_blocks) < num_luma ? 0 : (int)(k % num_mcu_blocks) - num_luma + 1;
+            out = coefs ? coefs + k * 64 : du;
+            tjei_quantize_impl(dct + k * 64, comp ? &pqt->chroma : &pqt->luma, out);
+            if ( freq ) {
+                ht = comp ? TJEI_CHROMA_DC : TJEI_LUMA_DC;
+                tjei_block_stats(out, &pred[comp], freq[ht], freq[ht + 1]);
+            }
+        }
+    }
+}
+
+// Size of the headers, which does not depend on the quality.
+static size_t tjei_header_size(TJEState* state, int width, int height)
+{
+    uint8_t scratch[TJEI_MAX_HEADER_SIZE];
+
+    state->write_context.func = NULL;
+    state->output_buffer = scratch;
+    state->output_buffer_count = 0;
+    state->output_buffer_size = sizeof(scratch);
+    state->output_overflow = 0;
+    tjei_write_headers(state, width, height);
+    state->output_buffer = NULL;
+    return state->output_buffer_count;
+}
+
+// Estimated JPEG size at the current quantisation tables, from every step-th MCU row. Code
+// lengths are those of the default tables, or of the tables optimised for these counts.
+// header_len is with the default tables.
+static size_t tjei_estimate_size(TJEState* state, const TJESample* dct, int step, size_t header_len)
+{
+    static const int default_vals[4] = { sizeof(tjei_default_ht_luma_dc), sizeof(tjei_default_ht_luma_ac),
+                                         sizeof(tjei_default_ht_chroma_dc), sizeof(tjei_default_ht_chroma_ac) };
+    uint32_t freq[4][257];
+    uint32_t scratch[257];
+    uint8_t code_size[256];
+    uint8_t opt_bits[16];
+    uint8_t opt_vals[256];
+    uint64_t bits = 0;
+    int rows, t, s, len, n;
+
+    memset(freq, 0, sizeof(freq));
+    tjei_quantize_blocks(state, dct, NULL, step, freq);
+    for ( t = 0; t < (state->num_components == 3 ? 4 : 2); ++t ) {
+        if ( state->optimize_huffman ) {
+            memcpy(scratch, freq[t], sizeof(scratch));  // Consumed by tjei_optimal_table().
+            tjei_optimal_table(scratch, opt_bits, opt_vals);
+            for ( len = 0, n = 0; len < 16; ++len ) {
+                for ( s = 0; s < opt_bits[len]; ++s ) {
+                    code_size[opt_vals[n++]] = (uint8_t)(len + 1);
+                }
+            }
+            header_len = header_len + n - default_vals[t];  // The DHT lists fewer symbols.
+        } else {
+            for ( s = 0; s < 256; ++s ) {
+                code_size[s] = (uint8_t)state->ehuff[t][s];
+            }
+        }
+        for ( s = 0; s < 256; ++s ) {
+            if ( freq[t][s] ) {
+                bits += (uint64_t)freq[t][s] * (code_size[s] + (s & 15));
+            }
+        }
+    }
+    rows = (state->mcu_rows + step - 1) / step;
+    bits = bits * state->mcu_rows / rows;
+    // Byte stuffing (a 0xFF byte in about every 256), restart markers and EOI.
+    return header_len + (size_t)(bits / 8 + bits / 2048) + 2 * state->mcu_rows + 2;
+}
+
+// Encode into dst at the highest quality, up to params->quality, whose JPEG fits capacity bytes.
+// The image is colour converted and transformed once; qualities are chosen from estimates on a
+// sample of the transformed blocks, and a retry at a lower quality only requantises. On success
+// *out_len is the JPEG size and *quality_out, if not NULL, the quality used. Returns
+// TJE_ERR_BUFFER_TOO_SMALL if even quality 1 does not fit.
+int tje_encode_image_to_size(const TJEParams* params, const TJEImage* image,
+                             uint8_t* dst, size_t capacity, size_t* out_len, int* quality_out)
+{
+    TJEState state = { 0 };
+    TJEQualityTables qt;
+    TJEPlan plan;
+    TJESample* dct;
+    size_t header_len;
+    int err, step, quality, lo, hi, mid, i;
+
+    *out_len = 0;
+    if (!tjei_check_image(image)) {
+        return TJE_ERR_PARAM;
+    }
+    err = tjei_setup(&state, params, image->format);
+    if (err != TJE_OK) {
+        return err;
+    }
+    state.qt = &qt;
+    err = tjei_plan(&state, image->width, image->height, 1, 64 * sizeof(TJESample), &plan);
+    if (err != TJE_OK) {
+        return err;
+    }
+    dct = (TJESample*)plan.extra;
+    tjei_transform_image(&state, image, dct);
+
+    // Largest quality whose estimate fits: a search on about a quarter of the MCU rows, then
+    // single steps to where the estimate on all rows crosses the budget.
+    step = state.mcu_rows >= 16 ? 4 : 1;
+    quality = params->quality;
+    tjei_build_quality(&qt, quality);
+    header_len = tjei_header_size(&state, image->width, image->height);
+    if (tjei_estimate_size(&state, dct, step, header_len) > capacity) {
+        lo = 1;
+        hi = quality - 1;
+        quality = 1;
+        while (lo <= hi) {
+            mid = (lo + hi) / 2;
+            tjei_build_quality(&qt, mid);
+            if (tjei_estimate_size(&state, dct, step, header_len) <= capacity) {
+                quality = mid;
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+        }
+    }
+    for ( ;; ) {
+        tjei_build_quality(&qt, quality);
+        if (quality == 1 || tjei_estimate_size(&state, dct, 1, header_len) <= capacity) {
+            break;
+        }
+        --quality;
+    }
+    while (quality < params->quality) {
+        tjei_build_quality(&qt, quality + 1);
+        if (tjei_estimate_size(&state, dct, 1, header_len) > capacity) {
+            break;
+        }
+        ++quality;
+    }
+
+    for ( ;; ) {
+        tjei_build_quality(&qt, quality);
+        tjei_quantize_blocks(&state, dct, plan.slices[0].coefs, 1, NULL);
+        state.write_context.func = NULL;
+        state.output_buffer = dst;
+        state.output_buffer_count = 0;
+        state.output_buffer_size = capacity;
+        state.output_overflow = 0;
+        if (state.optimize_huffman) {
+            for ( i = 0; i < plan.num_slices; ++i ) {
+                memset(plan.slices[i].freq, 0, 4 * 257 * sizeof(uint32_t));
+            }
+            tjei_run_slices(&state, image, plan.slices, plan.num_slices, TJEI_PASS_COUNT);
+            tjei_optimize_tables(&state, &plan);
+        }
+        tjei_write_headers(&state, image->width, image->height);
+        err = tjei_run_slices(&state, image, plan.slices, plan.num_slices, TJEI_PASS_EMIT);
+        if (err != TJE_OK) {
+            break;
+        }
+        tjei_write_trailer(&state);
+        if (!state.output_overflow) {
+            *out_len = state.output_buffer_count;
+            break;
+        }
+        if (quality == 1) {
+            err = TJE_ERR_BUFFER_TOO_SMALL;
+            break;
+        }
+        // The estimate was short: step down and requantise.
+        --quality;
+    }
+    tjei_plan_free(&plan);
+    if (quality_out) {
+        *quality_out = quality;
+    }
+    return err;
+}
+
+// Prepare an encoder for frames of the given source format. Returns TJE_OK or TJE_ERR_PARAM.
+// The encoder keeps its own tables, so encoders may be used from different threads.
+int tje_encoder_init(TJEEncoder* enc, const TJEParams* params, TJEColorFormat format)
+{
+    int err;
+
+    memset(enc, 0, sizeof(*enc));
+    err = tjei_setup(&enc->state, params, format);
+    if (err != TJE_OK) {
+        return err;
+    }
+    enc->format = format;
+    tjei_build_quality(&enc->qt, params->quality);
+    enc->state.qt = &enc->qt;
+    return TJE_OK;
+}
+
+// Serialise the headers for the frame size into the encoder's template, unless already done.
+// Optimised Huffman tables change per frame, those headers are always built.
+static void tjei_encoder_header(TJEEncoder* enc, int width, int height)
+{
+    TJEState* state = &enc->state;
+
+    if (state->optimize_huffman || (state->header && enc->header_width == width && enc->header_height == height)) {
+        return;
+    }
+    state->header = NULL;
+    if (width > 0xffff || height > 0xffff) {
+        return;
+    }
+    state->write_context.func = NULL;
+    state->output_buffer = enc->header;
+    state->output_buffer_count = 0;
+    state->output_buffer_size = sizeof(enc->header);
+    state->output_overflow = 0;
+    tjei_write_headers(state, width, height);
+    assert(!state->output_overflow);
+
+    enc->header_width = width;
+    enc->header_height = height;
+    enc->header_len = state->output_buffer_count;
+    state->header = enc->header;
+    state->header_len = enc->header_len;
+}
+
+int tje_encoder_encode(TJEEncoder* enc, const TJEImage* image, tje_write_func* func, void* context)
+{
+    if (image->format != enc->format || !tjei_check_image(image)) {
+        return TJE_ERR_PARAM;
+    }
+    tjei_encoder_header(enc, image->width, image->height);
+    return tjei_encode_to_func(&enc->state, image, func, context);
+}
+
+int tje_encoder_encode_to_buffer(TJEEncoder* enc, const TJEImage* image,
+                                 uint8_t* dst, size_t capacity, size_t* out_len)
+{
+    *out_len = 0;
+    if (image->format != enc->format || !tjei_check_image(image)) {
+        return TJE_ERR_PARAM;
+    }
+    tjei_encoder_header(enc, image->width, image->height);
+    return tjei_encode_to_buffer(&enc->state, image, dst, capacity, out_len);
+}
+
+// Non-zero if the n bytes at a and b differ.
+static int tjei_bytes_differ(const uint8_t* a, const uint8_t* b, size_t n)
+{
+#if TJEI_SIMD_X86
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc;
+
+    for ( ; n >= 64; a += 64, b += 64, n -= 64 ) {
+        acc = _mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b)),
+                           _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + 16)), _mm_loadu_si128((const __m128i*)(b + 16))));
+        acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + 32)), _mm_loadu_si128((const __m128i*)(b + 32))));
+        acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + 48)), _mm_loadu_si128((const __m128i*)(b + 48))));
+        if ( _mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff ) {
+            return 1;
+        }
+    }
+    for ( ; n >= 16; a += 16, b += 16, n -= 16 ) {
+        acc = _mm_xor_si128(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b));
+        if ( _mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff ) {
+            return 1;
+        }
+    }
+#endif
+    return n && memcmp(a, b, n) != 0;
+}
+
+// Re-encoding of frame sequences that are mostly static, such as fixed surveillance views. Every
+// MCU row is its own restart interval, so a row's entropy coded segment depends only on its
+// source rows. Each frame is compared row by row with the previous one; only MCU rows whose
+// source changed are coded and the other segments are copied from the previous JPEG. The output
+// is identical to tje_encoder_encode_to_buffer() with restart_rows = 1. Optimised Huffman
+// tables would differ between frames and are not available.
+typedef struct
+{
+    TJEEncoder  enc;
+    int         width;
+    int         height;
+    int         valid;         // prev_src and prev_jpeg hold a frame.
+    int         rows_encoded;  // MCU rows coded for the last frame.
+    size_t*     seg;           // Offset and length of each MCU row's segment in prev_jpeg.
+    size_t*     next_seg;      // The same for the frame being coded.
+    uint8_t*    changed;       // MCU rows coded for the frame being coded.
+    uint8_t*    prev_src;      // Source rows of the previous frame, planes packed one after another.
+    size_t      plane_offset[3];
+    uint8_t*    prev_jpeg;
+    size_t      prev_capacity;
+    uint8_t*    mem;
+} TJEDeltaEncoder;
+
+// Returns TJE_OK or TJE_ERR_PARAM.
+int tje_delta_init(TJEDeltaEncoder* delta, const TJEParams* params, TJEColorFormat format)
+{
+    TJEParams p = *params;
+    int err;
+
+    memset(delta, 0, sizeof(*delta));
+    if (params->optimize_huffman) {
+        return TJE_ERR_PARAM;
+    }
+    p.restart_rows = 1;
+    p.threads = 1;
+    err = tje_encoder_init(&delta->enc, &p, format);
+    return err;
+}
+
+void tje_delta_free(TJEDeltaEncoder* delta)
+{
+    TJE_FREE(delta->mem);
+    TJE_FREE(delta->prev_jpeg);
+    delta->mem = NULL;
+    delta->prev_jpeg = NULL;
+    delta->prev_capacity = 0;
+    delta->valid = 0;
+}
+
+// Source rows of plane p that feed MCU row r: [*first, return value).
+static int tjei_delta_rows(const TJEDeltaEncoder* delta, int p, int r, int* first)
+{
+    const int mcu_h = 8 * (delta->enc.state.sampling & 0xf);
+    const int halved = p > 0 && (delta->enc.format == TJE_I420 || delta->enc.format == TJE_NV12);
+    const int rows = halved ? (delta->height + 1) >> 1 : delta->height;
+    const int n = halved ? mcu_h / 2 : mcu_h;
+    const int end = (r + 1) * n;
+
+    *first = r * n;
+    return end < rows ? end : rows;
+}
+
+// Compare the source rows of MCU row r with the previous frame, or with store copy them over it.
+// Chroma is skipped for grayscale output, it does not reach the JPEG.
+static int tjei_delta_row(TJEDeltaEncoder* delta, const TJEImage* image, int r, int store)
+{
+    const int num_planes = delta->enc.state.num_components == 1 ? 1 : 3;
+    const uint8_t* src;
+    uint8_t* prev;
+    int p, y, end, n;
+
+    for ( p = 0; p < num_planes; ++p ) {
+        n = tjei_row_bytes(image->format, image->width, p);
+        if ( n == 0 ) {
+            continue;
+        }
+        end = tjei_delta_rows(delta, p, r, &y);
+        for ( ; y < end; ++y ) {
+            src = image->plane[p] + (size_t)y * image->stride[p];
+            prev = delta->prev_src + delta->plane_offset[p] + (size_t)y * n;
+            if ( store ) {
+                memcpy(prev, src, n);
+            } else if ( tjei_bytes_differ(src, prev, n) ) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Size the state for width x height frames, dropping the previous frame.
+static int tjei_delta_reset(TJEDeltaEncoder* delta, int width, int height)
+{
+    TJEState* state = &delta->enc.state;
+    size_t seg_size, src_size = 0;
+    int p, y, end;
+
+    TJE_FREE(delta->mem);
+    delta->mem = NULL;
+    delta->valid = 0;
+    if (!tjei_layout(state, width, height)) {
+        return TJE_ERR_PARAM;
+    }
+    delta->width = width;
+    delta->height = height;
+    for ( p = 0; p < 3; ++p ) {
+        delta->plane_offset[p] = src_size;
+        end = tjei_delta_rows(delta, p, state->mcu_rows - 1, &y);
+        src_size += (size_t)end * tjei_row_bytes(delta->enc.format, width, p);
+    }
+    seg_size = 2 * (size_t)state->mcu_rows * sizeof(size_t);
+    delta->mem = (uint8_t*)TJE_MALLOC(2 * seg_size + state->mcu_rows + src_size);
+    if (delta->mem == NULL) {
+        return TJE_ERR_NOMEM;
+    }
+    delta->seg = (size_t*)delta->mem;
+    delta->next_seg = (size_t*)(delta->mem + seg_size);
+    delta->changed = delta->mem + 2 * seg_size;
+    delta->prev_src = delta->changed + state->mcu_rows;
+    return TJE_OK;
+}
+
+// Encode the next frame into dst. The first frame, and any after a change of size, is coded in
+// full. Returns TJE_OK, TJE_ERR_PARAM, TJE_ERR_NOMEM or TJE_ERR_BUFFER_TOO_SMALL; after an error
+// the next frame is still compared with the last one encoded.
+int tje_delta_encode(TJEDeltaEncoder* delta, const TJEImage* image,
+                     uint8_t* dst, size_t capacity, size_t* out_len)
+{
+    TJEState* state = &delta->enc.state;
+    TJESlice slice;
+    size_t* seg;
+    int err, encoded = 0, r;
+
+    *out_len = 0;
+    if (image->format != delta->enc.format || !tjei_check_image(image)) {
+        return TJE_ERR_PARAM;
+    }
+    if (delta->mem == NULL || image->width != delta->width || image->height != delta->height) {
+        err = tjei_delta_reset(delta, image->width, image->height);
+        if (err != TJE_OK) {
+            return err;
+        }
+    }
+    tjei_layout(state, image->width, image->height);
+    tjei_encoder_header(&delta->enc, image->width, image->height);
+    if (state->header == NULL) {
+        return TJE_ERR_PARAM;
+    }
+
+    tjei_output_to_buffer(state, dst, capacity);
+    tjei_write(state, state->header, state->header_len, 1);
+    for ( r = 0; r < state->mcu_rows && !state->output_overflow; ++r ) {
+        if ( r ) {
+            tjei_write_restart(state, r - 1);
+        }
+        delta->next_seg[2 * r] = state->output_buffer_count;
+        delta->changed[r] = (uint8_t)(!delta->valid || tjei_delta_row(delta, image, r, 0));
+        if ( delta->changed[r] ) {
+            memset(&slice, 0, sizeof(slice));
+            slice.row_begin = r;
+            slice.row_end = r + 1;
+            tjei_encode_slice(state, image, &slice, TJEI_PASS_ENCODE);
+            ++encoded;
+        } else {
+            tjei_write(state, delta->prev_jpeg + delta->seg[2 * r], delta->seg[2 * r + 1], 1);
+        }
+        delta->next_seg[2 * r + 1] = state->output_buffer_count - delta->next_seg[2 * r];
+    }
+    tjei_write_trailer(state);
+    if (state->output_overflow) {
+        return TJE_ERR_BUFFER_TOO_SMALL;
+    }
+    *out_len = state->output_buffer_count;
+
+    // Keep this frame for the next one.
+    if (delta->prev_capacity < *out_len) {
+        TJE_FREE(delta->prev_jpeg);
+        delta->prev_capacity = *out_len + *out_len / 4;
+        delta->prev_jpeg = (uint8_t*)TJE_MALLOC(delta->prev_capacity);
+        if (delta->prev_jpeg == NULL) {
+            delta->prev_capacity = 0;
+            delta->valid = 0;  // The JPEG is fine, the next frame is coded in full.
+            return TJE_OK;
+        }
+    }
+    memcpy(delta->prev_jpeg, dst, *out_len);
+    for ( r = 0; r < state->mcu_rows; ++r ) {
+        if ( delta->changed[r] ) {
+            tjei_delta_row(delta, image, r, 1);
+        }
+    }
+    seg = delta->seg;
+    delta->seg = delta->next_seg;
+    delta->next_seg = seg;
+    delta->valid = 1;
+    delta->rows_encoded = encoded;
+    return TJE_OK;
+}
+
+// Strip-wise encoding for sources that arrive a few rows at a time. Each completed MCU row is
+// coded straight away, so at most one MCU row of input is kept. The encoder's restart_rows is
+// honoured; optimised Huffman tables need the whole image and are not available, and the rows
+// are coded on the calling thread. The encoder must not be used otherwise until tje_stream_end().
+typedef struct
+{
+    TJEEncoder* enc;
+    TJESlice    slice;
+    TJEImage    rows;      // Rows of the current MCU row that came in pieces.
+    uint8_t*    buffer;
+    int         width;
+    int         height;
+    int         received;  // Source rows so far.
+    int         buffered;  // Rows in buffer.
+    int         mcu_row;   // MCU rows coded.
+} TJEStream;
+
+// Start a width x height JPEG of the encoder's source format, written through func.
+// Returns TJE_OK, TJE_ERR_PARAM or TJE_ERR_NOMEM.
+int tje_stream_begin(TJEStream* stream, TJEEncoder* enc, int width, int height,
+                     tje_write_func* func, void* context)
+{
+    TJEState* state = &enc->state;
+    TJEImage* rows = &stream->rows;
+    const int mcu_h = 8 * (state->sampling & 0xf);
+    size_t size;
+    int p;
+
+    memset(stream, 0, sizeof(*stream));
+    if (state->optimize_huffman || !tjei_layout(state, width, height)) {
+        return TJE_ERR_PARAM;
+    }
+
+    rows->format = enc->format;
+    rows->width = width;
+    for (p = 0; p < 3; ++p) {
+        rows->stride[p] = tjei_row_bytes(enc->format, width, p);
+    }
+    // Chroma planes of 4:2:0 sources hold half as many rows.
+    size = (size_t)mcu_h * rows->stride[0] + (size_t)(mcu_h / 2) * (rows->stride[1] + rows->stride[2]);
+    stream->buffer = (uint8_t*)TJE_MALLOC(size);
+    if (stream->buffer == NULL) {
+        return TJE_ERR_NOMEM;
+    }
+    rows->plane[0] = stream->buffer;
+    if (rows->stride[1]) {
+        rows->plane[1] = rows->plane[0] + (size_t)mcu_h * rows->stride[0];
+    }
+    if (rows->stride[2]) {
+        rows->plane[2] = rows->plane[1] + (size_t)(mcu_h / 2) * rows->stride[1];
+    }
+    stream->enc = enc;
+    stream->width = width;
+    stream->height = height;
+
+    tjei_encoder_header(enc, width, height);
+    tjei_output_to_func(state, func, context);
+    tjei_write(state, state->header, state->header_len, 1);
+    tjei_slice_begin(&stream->slice);
+    return TJE_OK;
+}
+
+static void tjei_stream_row(TJEStream* stream, const TJEImage* rows)
+{
+    TJEState* state = &stream->enc->state;
+
+    tjei_encode_rows(state, rows, &stream->slice, 0, 1, TJEI_PASS_ENCODE);
+    ++stream->mcu_row;
+    if (state->restart_rows > 0 && stream->mcu_row % state->restart_rows == 0 && stream->mcu_row < state->mcu_rows) {
+        tjei_slice_end(state, &stream->slice, TJEI_PASS_ENCODE);
+        tjei_write_restart(state, stream->mcu_row / state->restart_rows - 1);
+        tjei_slice_begin(&stream->slice);
+    }
+}
+
+// Add the next strip->height rows of the image. Format and width must match the stream. Strips of
+// 4:2:0 sources start on even rows: all but the last have an even height.
+int tje_stream_write(TJEStream* stream, const TJEImage* strip)
+{
+    const int mcu_h = stream->buffer ? 8 * (stream->enc->state.sampling & 0xf) : 0;
+    const int halved = strip->format == TJE_I420 || strip->format == TJE_NV12;
+    TJEImage* rows = &stream->rows;
+    TJEImage view;
+    int done = 0, need, n, i, p;
+
+    if (stream->buffer == NULL || strip->format != rows->format || strip->width != stream->width ||
+        strip->height < 1 || strip->height > stream->height - stream->received || !tjei_check_image(strip)) {
+        return TJE_ERR_PARAM;
+    }
+    if (halved && (strip->height & 1) && stream->received + strip->height < stream->height) {
+        return TJE_ERR_PARAM;
+    }
+
+    while (done < strip->height) {
+        // Rows still missing from the current MCU row.
+        need = stream->height - stream->mcu_row * mcu_h;
+        need = (need < mcu_h ? need : mcu_h) - stream->buffered;
+        if (stream->buffered == 0 && strip->height - done >= need) {
+            // The strip covers the MCU row, code it in place.
+            view = *strip;
+            view.height = need;
+            for (p = 0; p < 3; ++p) {
+                if (view.plane[p]) {
+                    view.plane[p] += (size_t)(p && halved ? done / 2 : done) * strip->stride[p];
+                }
+            }
+            tjei_stream_row(stream, &view);
+            n = need;
+        } else {
+            n = strip->height - done < need ? strip->height - done : need;
+            for (i = 0; i < n; ++i) {
+                memcpy((uint8_t*)rows->plane[0] + (size_t)(stream->buffered + i) * rows->stride[0],
+                       strip->plane[0] + (size_t)(done + i) * strip->stride[0], rows->stride[0]);
+            }
+            for (p = 1; p < 3 && halved; ++p) {
+                for (i = 0; i < n && rows->stride[p]; i += 2) {
+                    memcpy((uint8_t*)rows->plane[p] + (size_t)((stream->buffered + i) / 2) * rows->stride[p],
+                           strip->plane[p] + (size_t)((done + i) / 2) * strip->stride[p], rows->stride[p]);
+                }
+            }
+            stream->buffered += n;
+            if (n == need) {
+                rows->height = stream->buffered;
+                tjei_stream_row(stream, rows);
+                stream->buffered = 0;
+            }
+        }
+        done += n;
+        stream->received += n;
+    }
+    return TJE_OK;
+}
+
+// Complete the JPEG and release the row buffer. If rows are missing the output is left
+// unfinished and TJE_ERR_PARAM returned.
+int tje_stream_end(TJEStream* stream)
+{
+    TJEState* state;
+
+    if (stream->buffer == NULL) {
+        return TJE_ERR_PARAM;
+    }
+    TJE_FREE(stream->buffer);
+    stream->buffer = NULL;
+    if (stream->received < stream->height) {
+        return TJE_ERR_PARAM;
+    }
+    state = &stream->enc->state;
+    tjei_slice_end(state, &stream->slice, TJEI_PASS_ENCODE);
+    tjei_write_trailer(state);
+    return TJE_OK;
+}
+
+// One frame of a batch: the source and output buffer in, the JPEG size and status out.
+typedef struct
+{
+    const TJEImage* image;
+    uint8_t*        dst;
+    size_t          capacity;
+    size_t          len;     // JPEG size, 0 on failure.
+    int             status;  // TJE_OK or a TJE_ERR_* code.
+} TJEBatchItem;
+
+struct TJEPool;
+
+typedef struct
+{
+    struct TJEPool* pool;
+    TJEEncoder      enc;  // Tables, Huffman codes and header template reused for every frame.
+#if TJE_USE_THREADS
+    pthread_t       thread;
+#endif
+} TJEPoolWorker;
+
+// Fixed set of workers for tje_encode_batch(). Threads and encoders are set up once by
+// tje_pool_init(); a batch costs no thread creation or allocation per frame. Without
+// TJE_USE_THREADS the pool has the calling thread only. A pool must not be copied or moved.
+typedef struct TJEPool
+{
+    TJEPoolWorker*  workers;      // [0] runs on the thread calling tje_encode_batch().
+    int             num_workers;
+#if TJE_USE_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t  work;         // A batch was posted, or quit was set.
+    pthread_cond_t  done;         // busy dropped to 0.
+    unsigned        generation;   // Batches posted.
+    int             busy;         // Threads still working on the current batch.
+    int             quit;
+#endif
+    TJEBatchItem*   items;
+    int             count;
+    int             next;         // Next item to take.
+} TJEPool;
+
+// Take items off the current batch until none are left.
+static void tjei_pool_drain(TJEPool* pool, TJEPoolWorker* worker)
+{
+    TJEBatchItem* item;
+    int i;
+
+    for ( ;; ) {
+#if TJE_USE_THREADS
+        pthread_mutex_lock(&pool->lock);
+#endif
+        i = pool->next < pool->count ? pool->next++ : -1;
+#if TJE_USE_THREADS
+        pthread_mutex_unlock(&pool->lock);
+#endif
+        if ( i < 0 ) {
+            return;
+        }
+        item = &pool->items[i];
+        item->status = tje_encoder_encode_to_buffer(&worker->enc, item->image, item->dst, item->capacity, &item->len);
+    }
+}
+
+#if TJE_USE_THREADS
+static void* tjei_pool_thread(void* arg)
+{
+    TJEPoolWorker* worker = (TJEPoolWorker*)arg;
+    TJEPool* pool = worker->pool;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for ( ;; ) {
+        while ( !pool->quit && pool->generation == seen ) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if ( pool->quit ) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        tjei_pool_drain(pool, worker);
+        pthread_mutex_lock(&pool->lock);
+        if ( --pool->busy == 0 ) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+#endif
+
+// Start a pool of threads workers (the calling thread included) for frames of the given format.
+// Each worker encodes whole frames on its own; params->threads is not used. Returns TJE_OK,
+// TJE_ERR_PARAM or TJE_ERR_NOMEM. If fewer threads can be started the pool runs with those.
+int tje_pool_init(TJEPool* pool, const TJEParams* params, TJEColorFormat format, int threads)
+{
+    int i, err;
+
+    memset(pool, 0, sizeof(*pool));
+#if !TJE_USE_THREADS
+    threads = 1;
+#endif
+    if (threads < 1) {
+        threads = 1;
+    }
+    pool->workers = (TJEPoolWorker*)TJE_MALLOC(threads * sizeof(TJEPoolWorker));
+    if (pool->workers == NULL) {
+        return TJE_ERR_NOMEM;
+    }
+    for (i = 0; i < threads; ++i) {
+        pool->workers[i].pool = pool;
+        err = tje_encoder_init(&pool->workers[i].enc, params, format);
+        if (err != TJE_OK) {
+            TJE_FREE(pool->workers);
+            pool->workers = NULL;
+            return err;
+        }
+        pool->workers[i].enc.state.threads = 1;
+    }
+    pool->num_workers = 1;
+#if TJE_USE_THREADS
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (i = 1; i < threads; ++i) {
+        if (pthread_create(&pool->workers[i].thread, NULL, tjei_pool_thread, &pool->workers[i]) != 0) {
+            break;
+        }
+        pool->num_workers = i + 1;
+    }
+#endif
+    return TJE_OK;
+}
+
+// Encode count frames into their own buffers, spread over the pool. Returns the number of frames
+// encoded; items[i].status tells why any other failed.
+int tje_encode_batch(TJEPool* pool, TJEBatchItem* items, int count)
+{
+    int i, ok = 0;
+
+    pool->items = items;
+    pool->count = count;
+    pool->next = 0;
+#if TJE_USE_THREADS
+    if (pool->num_workers > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->busy = pool->num_workers - 1;
+        ++pool->generation;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+#endif
+    tjei_pool_drain(pool, &pool->workers[0]);
+#if TJE_USE_THREADS
+    if (pool->num_workers > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->busy) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+#endif
+    pool->items = NULL;
+    pool->count = 0;
+
+    for (i = 0; i < count; ++i) {
+        ok += items[i].status == TJE_OK;
+    }
+    return ok;
+}
+
+void tje_pool_destroy(TJEPool* pool)
+{
+#if TJE_USE_THREADS
+    int i;
+
+    if (pool->workers == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 1; i < pool->num_workers; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    if (pool->workers) {
+        TJE_FREE(pool->workers);
+        pool->workers = NULL;
+    }
+}
+
+int tje_encode_with_params(tje_write_func* func, void* context, const TJEParams* params,
+                           const int width, const int height, TJEColorFormat color_format, const unsigned char* src_data)
+{
+    TJEImage image;
+
+    if (color_format < TJE_GRAY || color_format > TJE_RGBA) {
+        return 0;
+    }
+    memset(&image, 0, sizeof(image));
+    image.format = color_format;
+    image.width = width;
+    image.height = height;
+    image.plane[0] = src_data;
+    image.stride[0] = width * color_format;
+    return tje_encode_image(func, context, params, &image);
+}
+
+// quality 1..3: 1 is the base tables (50), 3 all ones (100), 2 roughly a tenth of the base tables (95).
+int tje_encode_with_func(tje_write_func* func, void* context, const int quality,
+                         const int width, const int height, TJEColorFormat color_format, const unsigned char* src_data)
+{
+    static const int levels[3] = { 50, 95, 100 };
+    TJEParams params;
+
+    if (quality < 1 || quality > 3) {
+        return 0;
+    }
+    tje_params_init(&params);
+    params.quality = levels[quality - 1];
+    return tje_encode_with_params(func, context, &params, width, height, color_format, src_data);
+}
+
+// Upper bound on the encoded size of a width x height image at the given quality (1..100), for
+// any sampling, Huffman tables and restart interval. Returns 0 for unsupported arguments.
+size_t tje_max_encoded_size(int width, int height, TJEColorFormat format, int quality)
+{
+    TJEQualityTables qt;
+    size_t bits_luma = 0, bits_chroma = 0, areas;
+    int i, m, size_luma, size_chroma;
+
+    if (width < 1 || height < 1 || width > 0xffff || height > 0xffff || quality < 1 || quality > 100) {
+        return 0;
+    }
+    if (format != TJE_GRAY && format != TJE_RGB565 && format != TJE_RGB888 && format != TJE_RGBA &&
+        format != TJE_I420 && format != TJE_NV12 && format != TJE_UYVY) {
+        return 0;
+    }
+
+    // Per block: every coefficient present with a 16-bit code. Transform coefficients of
+    // 8-bit samples stay within +-1024, DC differences need at most 11 magnitude bits.
+    tjei_get_quality(&qt, quality);
+    for ( i = 1; i < 64; ++i ) {
+        for ( m = 1024 / qt.luma[i] + 1, size_luma = 0; m; m >>= 1 ) {
+            ++size_luma;
+        }
+        for ( m = 1024 / qt.chroma[i] + 1, size_chroma = 0; m; m >>= 1 ) {
+            ++size_chroma;
+        }
+        bits_luma += 16 + (size_luma < 10 ? size_luma : 10);
+        bits_chroma += 16 + (size_chroma < 10 ? size_chroma : 10);
+    }
+    bits_luma += 16 + 11;
+    bits_chroma += 16 + 11;
+
+    // A 16x16 area holds at most 4 blocks per component (4:4:4). Every byte might need stuffing.
+    // Restart markers take 2 bytes per MCU row at most.
+    areas = (size_t)((width + 15) / 16) * (size_t)((height + 15) / 16);
+    return 2048 + 2 * areas * ((4 * bits_luma + 8 * bits_chroma + 7) / 8) + 2 * (size_t)((height + 7) / 8);
+}
+
+// Encode the width x height rectangle at (x, y) of an RGB565 frame whose rows are stride bytes
+// apart, without copying it out. The frame must hold the rectangle.
+// *out_jpeg_len is the buffer capacity on input, the JPEG size on output. Returns TJE_OK or a TJE_ERR_* code.
+int tje_jpeg_encode_rect(uint8_t *rgb565, int stride, int x, int y, int width, int height, int quality,
+                         uint8_t *out_jpeg, size_t *out_jpeg_len)
+{
+    TJEParams params;
+    TJEImage image;
+
+    if (x < 0 || y < 0) {
+        *out_jpeg_len = 0;
+        return TJE_ERR_PARAM;
+    }
+    tje_params_init(&params);
+    params.quality = quality;
+    memset(&image, 0, sizeof(image));
+    image.format = TJE_RGB565;
+    image.width = width;
+    image.height = height;
+    image.plane[0] = rgb565 + (size_t)y * stride + (size_t)x * 2;
+    image.stride[0] = stride;
+    return tje_encode_image_to_buffer(&params, &image, out_jpeg, *out_jpeg_len, out_jpeg_len);
+}
+
+// quality 1..100 as in libjpeg. *out_jpeg_len is the buffer capacity on input, the JPEG size on output.
+// Returns TJE_OK or a TJE_ERR_* code.
+int tje_jpeg_encode_quality(uint8_t *rgb565, int width, int height, int quality, uint8_t *out_jpeg, size_t *out_jpeg_len)
+{
+    return tje_jpeg_encode_rect(rgb565, width * 2, 0, 0, width, height, quality, out_jpeg, out_jpeg_len);
+}
+
+int tje_jpeg_encode(uint8_t *rgb565, int width, int height, uint8_t *out_jpeg, size_t *out_jpeg_len)
+{
+    return tje_jpeg_encode_quality(rgb565, width, height, 50, out_jpeg, out_jpeg_len);
 }
 
 #ifdef __cplusplus
@@ -22,6 +22,54 @@
 
 #include "tjpgd.h"
 
+#if JD_USE_STATS
+#ifndef JD_STATS_TICK
+#include <time.h>
+static uint64_t stats_tick (void) /* Monotonic time in unit of ns */
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#define JD_STATS_TICK() stats_tick()
+#endif
+#define JD_STAT(x)  x
+#define JD_LAP(jd, t) stats_lap(jd, &(jd)->stats.t)
+
+static void stats_lap (
+  JDEC* jd,   /* Pointer to the decompressor object */
+  uint64_t* acc /* Stage time to be charged with the time since the last stage boundary */
+)
+{
+  uint64_t t = JD_STATS_TICK();
+
+  *acc += t - jd->stats.tlast;
+  jd->stats.tlast = t;
+}
+
+static void stats_reset (
+  JDEC* jd    /* Pointer to the decompressor object */
+)
+{
+  uint8_t *p = (uint8_t*)&jd->stats;
+  unsigned int i;
+
+  for (i = 0; i < sizeof jd->stats; i++) p[i] = 0;
+  jd->stats.tlast = JD_STATS_TICK();
+}
+#else
+#define JD_STAT(x)
+#define JD_LAP(jd, t)
+#endif
+
+#if JD_USE_MEMSRC && defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define JD_SCAN_SSE2  1
+#else
+#define JD_SCAN_SSE2  0
+#endif
+
 
 /*-----------------------------------------------*/
 /* Zigzag-order to raster-order conversion table */
@@ -238,6 +286,32 @@ static JRESULT create_huffman_tbl ( /* 0:OK, !0:Failed */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Re-fill input buffer                                                  */
+/*-----------------------------------------------------------------------*/
+
+#if JD_USE_STATS
+static unsigned int stats_infunc (  /* Number of bytes read */
+  JDEC* jd,   /* Pointer to the decompressor object */
+  uint8_t* buff,  /* Input buffer */
+  unsigned int nd /* Number of bytes to read */
+)
+{
+  JD_LAP(jd, thuff);  /* Input is requested by the entropy decoder */
+  nd = jd->infunc(jd, buff, nd);
+  JD_LAP(jd, tfill);
+  jd->stats.nfill++; jd->stats.nfbyte += nd;
+
+  return nd;
+}
+#define INFUNC(jd, buff, nd)  stats_infunc(jd, buff, nd)
+#else
+#define INFUNC(jd, buff, nd)  (jd)->infunc(jd, buff, nd)
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Extract N bits from input stream                                      */
 /*-----------------------------------------------------------------------*/
@@ -258,7 +332,7 @@ static int bitext ( /* >=0: extracted data, <0: error code */
     if (!msk) {       /* Next byte? */
       if (!dc) {      /* No input data is available, re-fill input buffer */
         dp = jd->inbuf; /* Top of input buffer */
-        dc = jd->infunc(jd, dp, JD_SZBUF);
+        dc = INFUNC(jd, dp, JD_SZBUF);
         if (!dc) return 0 - (int)JDR_INP; /* Err: read error or wrong stream termination */
       } else {
         dp++;     /* Next data ptr */
@@ -312,7 +386,7 @@ static int huffext (  /* >=0: decoded data, <0: error code */
     if (!msk) {   /* Next byte? */
       if (!dc) {  /* No input data is available, re-fill input buffer */
         dp = jd->inbuf; /* Top of input buffer */
-        dc = jd->infunc(jd, dp, JD_SZBUF);
+        dc = INFUNC(jd, dp, JD_SZBUF);
         if (!dc) return 0 - (int)JDR_INP; /* Err: read error or wrong stream termination */
       } else {
         dp++; /* Next data ptr */
@@ -350,6 +424,144 @@ static int huffext (  /* >=0: decoded data, <0: error code */
 
 
 
+#if JD_USE_MEMSRC
+/*-----------------------------------------------------------------------*/
+/* Find next 0xFF byte in the resident image                             */
+/*-----------------------------------------------------------------------*/
+
+static const uint8_t* find_ff (  /* Pointer to the 0xFF byte (end: not found) */
+  const uint8_t* dp,    /* Start of the search */
+  const uint8_t* end    /* End of the search */
+)
+{
+#if JD_SCAN_SSE2
+  const __m128i ff = _mm_set1_epi8((char)0xFF);
+  int m;
+
+  while (dp + 16 <= end) {  /* Compare 16 bytes at a time */
+    m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)dp), ff));
+    if (m) return dp + __builtin_ctz((unsigned int)m);
+    dp += 16;
+  }
+#endif
+  while (dp < end && *dp != 0xFF) dp++;
+
+  return dp < end ? dp : end;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Fill the bit register from the resident image                         */
+/*-----------------------------------------------------------------------*/
+
+static void mem_fill (
+  JDEC* jd    /* Pointer to the decompressor object */
+)
+{
+  const uint8_t *dp = jd->mptr;
+  uint32_t reg = jd->mreg, w;
+  unsigned int nb = jd->mbit, n;
+
+
+  if (jd->mffp - dp >= 4) { /* Safe span: the look-ahead scan found no 0xFF or end of image in the next 4 bytes */
+    n = (32 - nb) >> 3;     /* Number of whole bytes the register can take (1 to 4) */
+    w = (uint32_t)dp[0] << 24 | (uint32_t)dp[1] << 16 | (uint32_t)dp[2] << 8 | dp[3];
+    reg |= (w & (0xFFFFFFFF << (32 - n * 8))) >> nb;  /* Load them at once, no per-byte checks */
+    jd->mptr = dp + n; jd->mreg = reg; jd->mbit = (uint8_t)(nb + n * 8);
+    return;
+  }
+
+  while (nb <= 24) {      /* Close to a 0xFF byte or the end of image: load byte by byte */
+    if (dp >= jd->mffp) {   /* Reached the 0xFF byte found by the look-ahead scan (or end of image) */
+      if (dp >= jd->mend - 1 || dp[0] != 0xFF || dp[1] != 0) break;  /* Marker or end of image: stop loading here */
+      reg |= (uint32_t)0xFF << (24 - nb); /* The flag is a data 0xFF */
+      dp += 2;
+      jd->mffp = find_ff(dp, jd->mend - 1); /* Scan for the next 0xFF ahead of the reader */
+    } else {
+      reg |= (uint32_t)*dp++ << (24 - nb);  /* No flag sequence can be here, get the byte as is */
+    }
+    nb += 8;
+  }
+
+  jd->mptr = dp; jd->mreg = reg; jd->mbit = (uint8_t)nb;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Extract N bits from the resident image                                */
+/*-----------------------------------------------------------------------*/
+
+static int bitext_mem ( /* >=0: extracted data, <0: error code */
+  JDEC* jd,   /* Pointer to the decompressor object */
+  unsigned int nbit    /* Number of bits to extract (1 to 11) */
+)
+{
+  uint32_t v;
+
+
+  if (jd->mbit < nbit) {
+    mem_fill(jd);
+    if (jd->mbit < nbit) return 0 - (int)JDR_INP; /* Err: wrong stream termination */
+  }
+  v = jd->mreg >> (32 - nbit);
+  jd->mreg <<= nbit; jd->mbit -= (uint8_t)nbit;
+
+  return (int)v;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Extract a huffman decoded data from the resident image                */
+/*-----------------------------------------------------------------------*/
+
+static int huffext_mem (  /* >=0: decoded data, <0: error code */
+  JDEC* jd,       /* Pointer to the decompressor object */
+  const uint8_t* hbits, /* Pointer to the bit distribution table */
+  const uint16_t* hcode,  /* Pointer to the code word table */
+  const uint8_t* hdata  /* Pointer to the data table */
+)
+{
+  uint32_t reg;
+  unsigned int v, bl, nb, nd;
+
+
+  if (jd->mbit < 16) mem_fill(jd);  /* Max code length */
+  reg = jd->mreg; nb = jd->mbit;
+
+  for (bl = 1; bl <= 16; bl++) {
+    if (bl > nb) return 0 - (int)JDR_INP; /* Err: wrong stream termination */
+    v = reg >> (32 - bl);
+    for (nd = *hbits++; nd; nd--) { /* Search the code word in this bit length */
+      if (v == *hcode++) {    /* Matched? */
+        jd->mreg = reg << bl; jd->mbit = (uint8_t)(nb - bl);
+        return *hdata;      /* Return the decoded data */
+      }
+      hdata++;
+    }
+  }
+
+  return 0 - (int)JDR_FMT1; /* Err: code not found (may be collapted data) */
+}
+
+#define HUFFEXT(jd, hb, hc, hd) ((jd)->mres ? huffext_mem(jd, hb, hc, hd) : huffext(jd, hb, hc, hd))
+#define BITEXT(jd, nb)      ((jd)->mres ? bitext_mem(jd, nb) : bitext(jd, nb))
+
+#else
+
+#define HUFFEXT(jd, hb, hc, hd) huffext(jd, hb, hc, hd)
+#define BITEXT(jd, nb)      bitext(jd, nb)
+
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Apply Inverse-DCT in Arai Algorithm (see also aa_idct.png)            */
 /*-----------------------------------------------------------------------*/
@@ -471,7 +683,9 @@ static void block_idct (
 /*-----------------------------------------------------------------------*/
 
 static JRESULT mcu_load (
-  JDEC* jd    /* Pointer to the decompressor object */
+  JDEC* jd,   /* Pointer to the decompressor object */
+  int16_t* cbuf,  /* Coefficient output buffer (NULL: apply IDCT and store to the MCU buffer) */
+  uint8_t dequant /* Coefficient output: 0:Quantized coefficients, 1:De-quantized coefficients */
 )
 {
   int32_t *tmp = (int32_t*)jd->workbuf; /* Block working buffer for de-quantize and IDCT */
@@ -495,54 +709,89 @@ static JRESULT mcu_load (
     hb = jd->huffbits[id][0];       /* Huffman table for the DC element */
     hc = jd->huffcode[id][0];
     hd = jd->huffdata[id][0];
-    b = huffext(jd, hb, hc, hd);      /* Extract a huffman coded data (bit length) */
+    b = HUFFEXT(jd, hb, hc, hd);      /* Extract a huffman coded data (bit length) */
     if (b < 0) return 0 - b;        /* Err: invalid code or input */
+    JD_STAT(jd->stats.nhuff++);
     d = jd->dcv[cmp];           /* DC value of previous block */
     if (b) {                /* If there is any difference from previous block */
-      e = bitext(jd, b);          /* Extract data bits */
+      e = BITEXT(jd, b);          /* Extract data bits */
       if (e < 0) return 0 - e;      /* Err: input */
+      JD_STAT(jd->stats.nbits += b);
       b = 1 << (b - 1);         /* MSB position */
       if (!(e & b)) e -= (b << 1) - 1;  /* Restore sign if needed */
       d += e;               /* Get current value */
       jd->dcv[cmp] = (int16_t)d;      /* Save current DC value for next block */
     }
     dqf = jd->qttbl[jd->qtid[cmp]];     /* De-quantizer table ID for this component */
-    tmp[0] = d * dqf[0] >> 8;       /* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+    if (JD_USE_COEF && cbuf) {
+      for (i = 1; i < 64; cbuf[i++] = 0) ; /* Clear AC elements */
+      cbuf[0] = (int16_t)(dequant ? d * (dqf[0] / IPSF(0)) : d);  /* Store DC element (de-quantize with the raw quantizer if required) */
+    } else {
+      tmp[0] = d * dqf[0] >> 8;       /* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+      for (i = 1; i < 64; tmp[i++] = 0) ; /* Clear rest of elements */
+    }
 
     /* Extract following 63 AC elements from input stream */
-    for (i = 1; i < 64; tmp[i++] = 0) ;   /* Clear rest of elements */
     hb = jd->huffbits[id][1];       /* Huffman table for the AC elements */
     hc = jd->huffcode[id][1];
     hd = jd->huffdata[id][1];
     i = 1;          /* Top of the AC elements */
     do {
-      b = huffext(jd, hb, hc, hd);    /* Extract a huffman coded value (zero runs and bit length) */
+      b = HUFFEXT(jd, hb, hc, hd);    /* Extract a huffman coded value (zero runs and bit length) */
       if (b == 0) break;          /* EOB? */
       if (b < 0) return 0 - b;      /* Err: invalid code or input error */
+      JD_STAT(jd->stats.nhuff++);
       z = (unsigned int)b >> 4;       /* Number of leading zero elements */
       if (z) {
         i += z;             /* Skip zero elements */
         if (i >= 64) return JDR_FMT1; /* Too long zero run */
       }
       if (b &= 0x0F) {          /* Bit length */
-        d = bitext(jd, b);        /* Extract data bits */
+        d = BITEXT(jd, b);        /* Extract data bits */
         if (d < 0) return 0 - d;    /* Err: input device */
+        JD_STAT(jd->stats.nbits += b);
         b = 1 << (b - 1);       /* MSB position */
         if (!(d & b)) d -= (b << 1) - 1;/* Restore negative value if needed */
         z = ZIG(i);           /* Zigzag-order to raster-order converted index */
-        tmp[z] = d * dqf[z] >> 8;   /* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+        if (JD_USE_COEF && cbuf) {
+          cbuf[z] = (int16_t)(dequant ? d * (dqf[z] / IPSF(z)) : d);  /* Store the coefficient (de-quantize if required, removing the exact Arai scale factor) */
+        } else {
+          tmp[z] = d * dqf[z] >> 8; /* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+        }
       }
     } while (++i < 64);   /* Next AC element */
 
+    if (JD_USE_COEF && cbuf) {
+      cbuf += 64;     /* Next coefficient block (IDCT and MCU buffer are not used) */
+      continue;
+    }
     if (JD_USE_SCALE && jd->scale == 3) {
       *bp = (uint8_t)((*tmp / 256) + 128);  /* If scale ratio is 1/8, IDCT can be ommited and only DC element is used */
     } else {
+#if JD_USE_STATS
+      tmp += 64;        /* Keep the block, the IDCTs of the MCU are applied and timed together below */
+#else
       block_idct(tmp, bp);    /* Apply IDCT and store the block to the MCU buffer */
+#endif
     }
 
     bp += 64;       /* Next block */
   }
 
+#if JD_USE_STATS
+  if (!(JD_USE_COEF && cbuf)) {
+    JD_LAP(jd, thuff);    /* Two time stamps per MCU rather than per block, so the timer does not dominate */
+    if (!JD_USE_SCALE || jd->scale != 3) {
+      tmp = (int32_t*)jd->workbuf;
+      for (blk = 0; blk < nby + nbc; blk++) {
+        block_idct(tmp + blk * 64, jd->mcubuf + blk * 64);  /* Apply IDCT and store the block to the MCU buffer */
+      }
+      JD_LAP(jd, tidct);
+      jd->stats.nidct += nby + nbc;
+    }
+  }
+#endif
+
   return JDR_OK;  /* All blocks have been loaded successfully */
 }
 
@@ -637,7 +886,12 @@ static JRESULT mcu_output (
   }
 
   /* Output the RGB rectangular */
-  return outfunc(jd, jd->workbuf, &rect) ? JDR_OK : JDR_INTR; 
+  JD_LAP(jd, tcolor);
+  JD_STAT(jd->stats.npix += rx * ry);
+  if (!outfunc(jd, jd->workbuf, &rect)) return JDR_INTR;
+  JD_LAP(jd, tout);
+
+  return JDR_OK;
 }
 
 
@@ -657,13 +911,25 @@ static JRESULT restart (
   uint8_t *dp;
 
 
+#if JD_USE_MEMSRC
+  if (jd->mres) { /* Resident image: the reader stops at the marker */
+    const uint8_t *mp = jd->mptr;
+
+    jd->mreg = 0; jd->mbit = 0;   /* Discard padding bits */
+    if (mp < jd->mffp || mp >= jd->mend - 1) return JDR_FMT1;  /* Err: marker is not there */
+    d = (uint16_t)(mp[0] << 8 | mp[1]);
+    jd->mptr = mp + 2;
+    jd->mffp = find_ff(jd->mptr, jd->mend - 1);
+  } else
+#endif
+  {
   /* Discard padding bits and get two bytes from the input stream */
   dp = jd->dptr; dc = jd->dctr;
   d = 0;
   for (i = 0; i < 2; i++) {
     if (!dc) {  /* No input data is available, re-fill input buffer */
       dp = jd->inbuf;
-      dc = jd->infunc(jd, dp, JD_SZBUF);
+      dc = INFUNC(jd, dp, JD_SZBUF);
       if (!dc) return JDR_INP;
     } else {
       dp++;
@@ -672,6 +938,7 @@ static JRESULT restart (
     d = (d << 8) | *dp; /* Get a byte */
   }
   jd->dptr = dp; jd->dctr = dc; jd->dmsk = 0;
+  }
 
   /* Check the marker */
   if ((d & 0xFFD8) != 0xFFD0 || (d & 7) != (rstn & 7)) {
@@ -716,6 +983,9 @@ JRESULT jd_prepare (
   jd->infunc = infunc;  /* Stream input function */
   jd->device = dev;   /* I/O device identifier */
   jd->nrst = 0;     /* No restart interval (default) */
+#if JD_USE_MEMSRC
+  jd->mres = 0;     /* Streaming input (default) */
+#endif
 
   for (i = 0; i < 2; i++) { /* Nulls pointers */
     for (j = 0; j < 2; j++) {
@@ -825,6 +1095,9 @@ JRESULT jd_prepare (
       if (!n) return JDR_FMT1;          /* Err: SOF0 has not been loaded */
       len = n * 64 * 2 + 64;            /* Allocate buffer for IDCT and RGB output */
       if (len < 256) len = 256;         /* but at least 256 byte is required for IDCT */
+#if JD_USE_STATS
+      if (len < (n + 2) * 64 * sizeof (int32_t)) len = (n + 2) * 64 * sizeof (int32_t); /* IDCT input of all blocks in the MCU */
+#endif
       jd->workbuf = alloc_pool(jd, len);      /* and it may occupy a part of following MCU working buffer for RGB output */
       if (!jd->workbuf) return JDR_MEM1;      /* Err: not enough memory */
       jd->mcubuf = (uint8_t*)alloc_pool(jd, (unsigned int)((n + 2) * 64));  /* Allocate MCU working buffer */
@@ -866,6 +1139,62 @@ JRESULT jd_prepare (
 
 
 
+#if JD_USE_MEMSRC
+/*-----------------------------------------------------------------------*/
+/* Analyze a resident JPEG image and Initialize decompressor object      */
+/*-----------------------------------------------------------------------*/
+
+static unsigned int mem_input ( /* Number of bytes read */
+  JDEC* jd,     /* Pointer to the decompressor object */
+  uint8_t* buff,    /* Read buffer (NULL: skip bytes) */
+  unsigned int nd   /* Number of bytes to read */
+)
+{
+  unsigned int i, rb;
+
+
+  rb = (unsigned int)(jd->mend - jd->mptr);
+  if (nd > rb) nd = rb;
+  if (buff) {
+    for (i = 0; i < nd; i++) buff[i] = jd->mptr[i];
+  }
+  jd->mptr += nd;
+
+  return nd;
+}
+
+
+JRESULT jd_prepare_mem (
+  JDEC* jd,     /* Blank decompressor object */
+  const uint8_t* data,  /* JPEG image (must be kept until the decompression is completed) */
+  unsigned int ndata,   /* Size of the JPEG image */
+  void* pool,     /* Working buffer for the decompression session */
+  unsigned int sz_pool, /* Size of working buffer */
+  void* dev     /* I/O device identifier for the session */
+)
+{
+  JRESULT rc;
+
+
+  if (!data || ndata < 4) return JDR_PAR;
+
+  jd->mptr = data; jd->mend = data + ndata;
+  rc = jd_prepare(jd, mem_input, pool, sz_pool, dev); /* Analyze the headers */
+  if (rc != JDR_OK) return rc;
+
+  /* Start of the entropy coded data (put back the bytes pre-loaded into the input buffer) */
+  jd->mptr -= jd->dctr;
+  jd->mreg = 0; jd->mbit = 0;
+  jd->mffp = find_ff(jd->mptr, jd->mend - 1); /* Look ahead for the first marker or flag sequence */
+  jd->mres = 1;
+
+  return JDR_OK;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Start to decompress the JPEG picture                                  */
 /*-----------------------------------------------------------------------*/
@@ -888,6 +1217,7 @@ JRESULT jd_decomp (
 
   jd->dcv[2] = jd->dcv[1] = jd->dcv[0] = 0; /* Initialize DC values */
   rst = rsc = 0;
+  JD_STAT(stats_reset(jd));
 
   rc = JDR_OK;
   for (y = 0; y < jd->height; y += my) {    /* Vertical loop of MCUs */
@@ -897,7 +1227,7 @@ JRESULT jd_decomp (
         if (rc != JDR_OK) return rc;
         rst = 1;
       }
-      rc = mcu_load(jd);          /* Load an MCU (decompress huffman coded stream and apply IDCT) */
+      rc = mcu_load(jd, 0, 0);        /* Load an MCU (decompress huffman coded stream and apply IDCT) */
       if (rc != JDR_OK) return rc;
       rc = mcu_output(jd, outfunc, x, y); /* Output the MCU (color space conversion, scaling and output) */
       if (rc != JDR_OK) return rc;
@@ -906,3 +1236,64 @@ JRESULT jd_decomp (
 
   return rc;
 }
+
+
+
+
+#if JD_USE_COEF
+/*-----------------------------------------------------------------------*/
+/* Decompress the JPEG picture into DCT coefficients (no IDCT and no     */
+/* color conversion)                                                     */
+/*-----------------------------------------------------------------------*/
+
+JRESULT jd_decomp_coef (
+  JDEC* jd,               /* Initialized decompression object */
+  int (*coeffunc)(JDEC*, int16_t*, JRECT*), /* Coefficient output function */
+  uint8_t dequant           /* 0:Quantized coefficients, 1:De-quantized coefficients */
+)
+{
+  unsigned int x, y, mx, my, rx, ry, n;
+  uint16_t rst, rsc;
+  int16_t *cbuf;
+  JRECT rect;
+  JRESULT rc;
+
+
+  /* Coefficient blocks occupy the IDCT/RGB working buffer and the following MCU working buffer */
+  n = jd->msx * jd->msy + 2;          /* Number of blocks in the MCU */
+  if ((uint8_t*)jd->mcubuf <= (uint8_t*)jd->workbuf
+    || (unsigned int)(jd->mcubuf + n * 64 - (uint8_t*)jd->workbuf) < n * 64 * sizeof (int16_t)) {
+    return JDR_MEM1;              /* Err: the working buffers are not contiguous or too small */
+  }
+  cbuf = (int16_t*)jd->workbuf;
+  jd->scale = 0;
+
+  mx = jd->msx * 8; my = jd->msy * 8;     /* Size of the MCU (pixel) */
+
+  jd->dcv[2] = jd->dcv[1] = jd->dcv[0] = 0; /* Initialize DC values */
+  rst = rsc = 0;
+  JD_STAT(stats_reset(jd));
+
+  rc = JDR_OK;
+  for (y = 0; y < jd->height; y += my) {    /* Vertical loop of MCUs */
+    for (x = 0; x < jd->width; x += mx) { /* Horizontal loop of MCUs */
+      if (jd->nrst && rst++ == jd->nrst) {  /* Process restart interval if enabled */
+        rc = restart(jd, rsc++);
+        if (rc != JDR_OK) return rc;
+        rst = 1;
+      }
+      rc = mcu_load(jd, cbuf, dequant);   /* Load an MCU (decompress huffman coded stream only) */
+      if (rc != JDR_OK) return rc;
+      rx = (x + mx <= jd->width) ? mx : jd->width - x;  /* Rectangular area of the MCU (it may be clipped at right/bottom end) */
+      ry = (y + my <= jd->height) ? my : jd->height - y;
+      rect.left = x; rect.right = x + rx - 1;
+      rect.top = y; rect.bottom = y + ry - 1;
+      JD_LAP(jd, thuff);
+      if (!coeffunc(jd, cbuf, &rect)) return JDR_INTR;  /* Output the coefficient blocks */
+      JD_LAP(jd, tout);
+    }
+  }
+
+  return rc;
+}
+#endif
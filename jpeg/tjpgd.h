@@ -10,6 +10,9 @@
 #define JD_FORMAT       1   /* Output pixel format 0:RGB888 (3 BYTE/pix), 1:RGB565 (1 WORD/pix) */
 #define JD_USE_SCALE    1   /* Use descaling feature for output */
 #define JD_TBLCLIP      1   /* Use table for saturation (might be a bit faster but increases 1K bytes of code size) */
+#define JD_USE_COEF     1   /* Use coefficient output feature (jd_decomp_coef) */
+#define JD_USE_MEMSRC   1   /* Use fast decoding from a fully resident JPEG image (jd_prepare_mem) */
+#define JD_USE_STATS    0   /* Collect decoding stage statistics into JDEC.stats (JD_STATS_TICK() may be defined as a cycle counter, needs up to 1K bytes more work area) */
 /*---------------------------------------------------------------------------*/
 
 #ifdef __cplusplus
@@ -40,6 +43,26 @@ typedef struct {
 
 
 
+#if JD_USE_STATS
+/* Decoding stage statistics (reset by jd_decomp, times in JD_STATS_TICK() unit) */
+typedef struct {
+    uint32_t nhuff;             /* Number of huffman decoded symbols */
+    uint32_t nbits;             /* Number of extracted data bits */
+    uint32_t nidct;             /* Number of IDCT blocks */
+    uint32_t npix;              /* Number of output pixels */
+    uint32_t nfill;             /* Number of input buffer refills */
+    uint32_t nfbyte;            /* Number of bytes read by the refills */
+    uint64_t thuff;             /* Time of entropy decoding and de-quantization */
+    uint64_t tidct;             /* Time of IDCT */
+    uint64_t tcolor;            /* Time of color conversion */
+    uint64_t tout;              /* Time of output function */
+    uint64_t tfill;             /* Time of input function */
+    uint64_t tlast;             /* Time stamp of the last stage boundary */
+} JSTATS;
+#endif
+
+
+
 /* Decompressor object structure */
 typedef struct JDEC_s JDEC;
 struct JDEC_s {
@@ -64,11 +87,29 @@ struct JDEC_s {
     unsigned int (*infunc)(JDEC*, uint8_t*, unsigned int);/* Pointer to jpeg stream input function */
     void* device;               /* Pointer to I/O device identifiler for the session */
 	uint8_t swap;               /* Added by Bodmer to control byte swapping */
+#if JD_USE_MEMSRC
+    const uint8_t* mptr;        /* Current read ptr in the resident image */
+    const uint8_t* mend;        /* End of the resident image */
+    const uint8_t* mffp;        /* Next 0xFF byte ahead of the read ptr (look-ahead scan) */
+    uint32_t mreg;              /* Bit register of the resident image reader (MSB first) */
+    uint8_t mbit;               /* Number of valid bits in the bit register */
+    uint8_t mres;               /* Decoding from the resident image */
+#endif
+#if JD_USE_STATS
+    JSTATS stats;               /* Decoding stage statistics */
+#endif
 };
 
 /* TJpgDec API functions */
 JRESULT jd_prepare (JDEC* jd, unsigned int (*infunc)(JDEC*,uint8_t*,unsigned int), void* pool, unsigned int sz_pool, void* dev);
 JRESULT jd_decomp (JDEC* jd, int (*outfunc)(JDEC*,void*,JRECT*), uint8_t scale);
+#if JD_USE_MEMSRC
+JRESULT jd_prepare_mem (JDEC* jd, const uint8_t* data, unsigned int ndata, void* pool, unsigned int sz_pool, void* dev);
+#endif
+#if JD_USE_COEF
+/* Coefficient output: coeffunc receives the MCU as (Y blocks + Cb + Cr) x 64 coefficients in raster order */
+JRESULT jd_decomp_coef (JDEC* jd, int (*coeffunc)(JDEC*,int16_t*,JRECT*), uint8_t dequant);
+#endif
 
 
 #ifdef __cplusplus